@@ -8,6 +8,8 @@
 #include <iostream>
 #include <sstream>
 #include <limits>
+#include <iterator>
+#include <stdint.h>
 #include "Matrix.h"
 #include "Point.h"
 #include "LinearTransform.h"
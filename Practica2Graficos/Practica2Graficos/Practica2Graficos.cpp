@@ -49,7 +49,100 @@ void drawLine(Canvas *, int, int, int, int, Color);
 void drawTriangle(Canvas *, int, int, double, int, int, double, int, int, double, Color);
 
 
+// Cabecera de un archivo .lff (malla compilada, ver final.cpp)
+typedef struct
+{
+	char magic[4];
+	uint32_t byteOrder;
+	uint32_t vertexCount;
+	uint32_t faceCount;
+	uint32_t indexCount;
+	uint32_t flags;
+	uint64_t vertexOffset;
+	uint64_t faceOffset;
+	uint64_t indexOffset;
+	uint64_t materialOffset;
+	uint64_t normalOffset;
+} LffHeader;
+
+const char LFF_MAGIC[4] = {'L', 'F', 'F', '1'};
+const uint32_t LFF_BYTE_ORDER = 0x01020304;
+
+size_t lffAlign(size_t n) {
+	return (n + 63) & ~(size_t)63;
+}
+
+// Comprueba que count elementos de elementSize bytes desde offset caben en size
+// bytes sin que ninguna suma o producto desborde
+bool lffFits(uint64_t offset, uint64_t count, uint64_t elementSize, size_t size) {
+	if (offset > size) {
+		return false;
+	}
+	return elementSize == 0 || count <= (size - offset) / elementSize;
+}
+
+Matrix *matrixFromLff(char *fileName, vector<int> *lineEndings) {
+	ifstream file;
+	file.open(fileName, ios::binary);
+	vector<char> data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+	file.close();
+
+	LffHeader hd;
+	if (data.size() < sizeof(LffHeader)) {
+		return NULL;
+	}
+	memcpy(&hd, &data[0], sizeof(LffHeader));
+	if (memcmp(hd.magic, LFF_MAGIC, 4) != 0 || hd.byteOrder != LFF_BYTE_ORDER
+		|| !lffFits(hd.vertexOffset, hd.vertexCount, sizeof(float), data.size())) {
+		return NULL;
+	}
+	size_t vBlock = lffAlign((size_t)hd.vertexCount * sizeof(float));
+	if (!lffFits(hd.vertexOffset, 3, vBlock, data.size())
+		|| !lffFits(hd.faceOffset, (uint64_t)hd.faceCount + 1, sizeof(uint32_t), data.size())
+		|| !lffFits(hd.indexOffset, hd.indexCount, sizeof(uint32_t), data.size())) {
+		return NULL;
+	}
+	const float *vx = (const float *)&data[hd.vertexOffset];
+	const float *vy = (const float *)&data[hd.vertexOffset + vBlock];
+	const float *vz = (const float *)&data[hd.vertexOffset + 2 * vBlock];
+	const uint32_t *face = (const uint32_t *)&data[hd.faceOffset];
+	const uint32_t *index = (const uint32_t *)&data[hd.indexOffset];
+
+	Matrix *m = new Matrix(4, 0);
+	for (uint32_t f = 0; f < hd.faceCount; f++) {
+		for (uint32_t i = face[f]; i < face[f + 1] && i < hd.indexCount; i++) {
+			uint32_t v = index[i];
+			if (v >= hd.vertexCount) {
+				delete m;
+				return NULL;
+			}
+			m->addColumn();
+			m->setValue(0, m->cols - 1, vx[v]);
+			m->setValue(1, m->cols - 1, vy[v]);
+			m->setValue(2, m->cols - 1, vz[v]);
+			m->setValue(3, m->cols - 1, 1);
+		}
+
+		// Guardar fines de lineas para separar caras
+		lineEndings->push_back(m->cols - 1);
+	}
+
+	return m;
+}
+
+bool isLffFile(char *fileName) {
+	char magic[4];
+	ifstream file;
+	file.open(fileName, ios::binary);
+	file.read(magic, 4);
+	return file.gcount() == 4 && memcmp(magic, LFF_MAGIC, 4) == 0;
+}
+
 Matrix *matrixFromRaw(char *fileName, vector<int> *lineEndings) {
+	if (isLffFile(fileName)) {
+		return matrixFromLff(fileName, lineEndings);
+	}
+
 	ifstream file;
 	file.open(fileName);
 	Matrix *m = new Matrix(4, 0);
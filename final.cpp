@@ -4,11 +4,12 @@
  * Adonais Romero Gonzlez
  *
  *
- * This program reads a .raw file, representing a 3D model, and generates a projected 2D picture from it, saved in PPM format.
+ * This program reads a .raw or .lff file, representing a 3D model, and generates a projected 2D picture from it, saved in PPM format.
+ * A .lff file is a compiled binary mesh (see LffHeader); when both exist, [filename].lff is preferred over [filename].raw.
  *
  * The program can recieve many parameters as arguments from command line:
  *     [filename]
- *         File name of the files to be read (in, by default).
+ *         File name of the files to be read (in, by default). An explicit .raw or .lff extension selects the mesh file.
  *     -w [width]
  *         Width of the image result.
  *     -h [height]
@@ -25,24 +26,143 @@
  *         Disables use of depth buffer
  *     --ambient
  *         Uses ambient light (all faces illuminated at highest intensity).
+ *     --convert
+ *         Compiles [filename].raw into [filename].lff and exits without rendering.
+ *     --weld [epsilon]
+ *         Vertices of a .raw file closer than epsilon on every axis are merged into one (0, exact matches only, by default).
+ *     -r [scanline|edge]
+ *         Triangle rasterizer: scanline walker (default) or half-space edge functions evaluated in 8x8 blocks.
+ *     -t [threads]
+ *         Bins triangles into 64x64 tiles and rasterizes the tiles on this many threads (0, one per core) with the
+ *         edge rasterizer. The picture is identical to -r edge for any thread count.
+ *     --deferred
+ *         Rasterizes face ids into a visibility buffer with the edge rasterizer and shades every pixel once afterwards.
+ *     --sort
+ *         Draws visible triangles front to back instead of in file order, so fewer hidden pixels get written.
+ *     --layout [linear|tiled]
+ *         Frame buffer layout: row-major (default) or 8x8 blocks with pixels in Morton order.
+ *     -o [file]
+ *         Output image (out.ppm by default). The extension selects the format: .ppm, .qoi or .png.
+ *     --png [deflate|stored]
+ *         PNG compression: deflate (default) or stored blocks only, which is faster but larger.
+ *     --pipeline
+ *         Encodes and writes the image on a separate thread while it is rendered. With -t, each band of rows is
+ *         written as soon as its tiles are finished.
+ *     --band [rows]
+ *         Renders the picture in horizontal bands of this many rows (rounded up to a multiple of 64), from the top
+ *         down, writing each band out before drawing the next, so memory follows the band size instead of the image
+ *         size. Meant for posters too large for a whole frame buffer. --pipeline only applies without bands.
+ *     --frames [count]
+ *         Renders this many frames in one run. If [filename].scene holds a camera path (see cameraPathFromFile:
+ *         more keyframes, a bezier or hermite curve for the position, or a target), it is sampled evenly from start
+ *         to end, by default once per keyframe or 100 times along a curve. Otherwise the frames are a turntable:
+ *         camera, direction and light turn once around the up vector through the centre of the model's bounding
+ *         box. Image files get the frame number before the extension (out_0000.ppm, ...), while .y4m and .rgb
+ *         outputs hold all the frames.
+ *     --stream [y4m|rgb]
+ *         Writes the frames to standard output as a YUV4MPEG2 stream (4:2:0, 25 fps) or as raw RGB24 frames, to be
+ *         piped into a video encoder. -o with a .y4m or .rgb extension writes the same stream to a file.
+ *     --stereo [sbs|anaglyph]
+ *         Renders a stereo pair, the eyes side by side in an image twice as wide or as a red-cyan anaglyph. Both eyes
+ *         look along the camera direction, converged on the centre of the model, and share the culling, shading and
+ *         projection work; only the rasterization is done twice.
+ *     --eyes [distance]
+ *         Distance between the eyes for --stereo (0.2 by default).
+ *     --stats
+ *         Prints rendering counters to stderr: how many triangles and 8x8 blocks the hierarchical depth buffer
+ *         rejected (edge rasterizer only) and the overdraw, pixel writes per covered pixel.
+ *     --occlusion
+ *         Occlusion culling with the edge rasterizer. The bounding volume hierarchy is walked front to back; the
+ *         nearest faces are drawn into a coarse depth buffer of 8x8 blocks, and a part of the model whose screen box
+ *         lies wholly behind them is skipped before its vertices are transformed. Meant for scenes where near objects
+ *         hide far ones; the picture is that of -r edge, but for the odd pixel a sliver triangle won with a depth
+ *         extrapolated past its corners. With --stats, prints per frame how many boxes were hidden and the faces they
+ *         held. Ignored with -W, --stereo and --depthdisable.
  *
- * The result is saved in a out.ppm file.
+ * The result is saved in out.ppm unless -o names another file. QOI and PNG are encoded in strips, in parallel
+ * with -t.
+ * Building with GCC or Clang needs -pthread for the tiled renderer.
  */
 
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cmath>
+#include <climits>
 #include <limits>
-#include <list>
 #include <vector>
 #include <fstream>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdint.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#define USE_AVX
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 using namespace std;
 
 #define BUFFER_SIZE 1024
+#define LFF_ALIGN 64
+#define LFF_BYTE_ORDER 0x01020304u
+#define TILE_SIZE 64
+#define STRIP_ROWS 64
+#define PI 3.14159265358979323846
+#define NEAR_W 1e-3f
+#define GUARD_BAND 8192
+#define CLIP_MAX 16
+#define BVH_LEAF 16
+#define OCCLUDER_TRIANGLES 2048
 
 typedef unsigned char uchar;
 
+enum Layout
+{
+	LAYOUT_LINEAR,
+	LAYOUT_TILED
+};
+
+enum ImageFormat
+{
+	IMAGE_PPM,
+	IMAGE_QOI,
+	IMAGE_PNG,
+	IMAGE_Y4M,
+	IMAGE_RGB
+};
+
+enum StereoMode
+{
+	STEREO_NONE,
+	STEREO_SIDE_BY_SIDE,
+	STEREO_ANAGLYPH
+};
+
+enum Rasterizer
+{
+	RASTER_SCANLINE,
+	RASTER_EDGE
+};
+
 typedef struct
 {
 	unsigned short r;
@@ -55,12 +175,22 @@ typedef struct
 const Color COLOR_BLACK = {0, 0, 0};
 const Color COLOR_WHITE = {255, 255, 255};
 
+/*
+ * Fixed size 4x4 matrix and homogeneous vector. Both are plain aggregates, so
+ * they live on the stack and can be built in constant expressions.
+ */
 typedef struct
 {
-	double **val;
-	int r;
-	int c;
-} Matrix;
+	float m[4][4];
+} Mat4;
+
+typedef struct
+{
+	float x;
+	float y;
+	float z;
+	float w;
+} Vec4;
 
 typedef struct
 {
@@ -69,637 +199,4938 @@ typedef struct
 	double z;
 } Point3D;
 
+/*
+ * Counters filled in while rendering when --stats is given. They are shared
+ * by all tile threads, so every rasterizer call adds its totals once; with
+ * tiles a triangle counts once per tile it was binned to, and with bands
+ * once per band. covered is added up by main from countCovered.
+ */
+typedef struct
+{
+	atomic<long long> triangles, trianglesCulled;
+	atomic<long long> blocks, blocksCulled;
+	atomic<long long> fragments, fragmentsWritten;
+	long long covered;
+} RenderStats;
+
+/*
+ * Frame buffer. Colours are packed RGB8 in rgb, depth in z and the optional
+ * visibility buffer in id; all three are 64 byte aligned. With LAYOUT_LINEAR
+ * they are row-major, colour row y starting stride bytes after row y - 1.
+ * With LAYOUT_TILED the canvas is padded to whole 8x8 blocks, stored one
+ * after another in row-major block order, and the 64 pixels of a block are
+ * in Morton (Z) order, so a block is contiguous in every buffer. Use
+ * canvasIndex and canvasColor to address pixels; blockOffset and colorOffset
+ * give the position of pixel i + 8 * j of a block relative to its first one.
+ *
+ * Besides the depth buffer z, a canvas keeps a two level hierarchical Z: the
+ * farthest depth of every 8x8 block (zBlock) and of every TILE_SIZE tile
+ * (zTile). Writes to z only flag the block and tile as dirty; the maximum is
+ * recomputed the next time it is needed, so it is never nearer than the real
+ * buffer contents.
+ *
+ * Clearing is lazy: clearCanvas only bumps generation, and a TILE_SIZE tile
+ * whose tileGeneration differs holds stale data that reads as black and
+ * infinitely far. clearTile resets a tile the first time it is drawn to.
+ *
+ * A canvas may hold only rows [originY, originY + h) of a taller image, as
+ * when a poster is rendered in bands. The rasterizers, drawPixel and
+ * canvasRow take image rows; everything else addresses the canvas itself.
+ */
 typedef struct
 {
-	Color **col;
+	uchar *rgb;
+	int stride;
 	int w;
 	int h;
-	double **z;
+	int originY;
+	float *z;
+	int *id;
 	bool zEnabled;
+	Layout layout;
+	int blockOffset[64], colorOffset[64];
+	float *zBlock, *zTile;
+	uchar *zBlockDirty, *zTileDirty;
+	int blocksX, blocksY, tilesX, tilesY;
+	unsigned generation;
+	unsigned *tileGeneration;
+	RenderStats *stats;
 } Canvas;
 
-typedef list<Point3D> Face3D;
-typedef list<Face3D> Map3D;
+/*
+ * Canvases released after a frame, kept to be handed out again by
+ * acquireCanvas instead of allocating new buffers.
+ */
+typedef struct
+{
+	vector<Canvas *> canvases;
+} CanvasPool;
+
+/*
+ * Index of the 8x8 block corner (x, y), x and y multiples of 8, in z and id.
+ */
+inline size_t canvasBlockIndex(Canvas *c, int x, int y)
+{
+	if (c->layout == LAYOUT_TILED)
+		return ((size_t)(y >> 3) * c->blocksX + (x >> 3)) << 6;
+	return (size_t)y * c->w + x;
+}
+
+/*
+ * Index of pixel (x, y) in z and id.
+ */
+inline size_t canvasIndex(Canvas *c, int x, int y)
+{
+	return canvasBlockIndex(c, x & ~7, y & ~7) + c->blockOffset[8 * (y & 7) + (x & 7)];
+}
+
+/*
+ * Address of the colour of pixel (x, y).
+ */
+inline uchar *canvasColor(Canvas *c, int x, int y)
+{
+	if (c->layout == LAYOUT_TILED)
+		return c->rgb + 3 * canvasIndex(c, x, y);
+	return c->rgb + (size_t)y * c->stride + 3 * x;
+}
+
+/*
+ * Whether the tile holding pixel (x, y) has been cleared for this frame.
+ */
+inline bool tileLive(Canvas *c, int x, int y)
+{
+	return c->tileGeneration[(y / TILE_SIZE) * c->tilesX + x / TILE_SIZE] == c->generation;
+}
+
+/*
+ * Header of a compiled .lff mesh. All fields are little endian and every
+ * block starts at a multiple of LFF_ALIGN bytes from the start of the file,
+ * so a mapped file can be read in place:
+ *     vertex   float x[vertexCount], y[vertexCount], z[vertexCount] (each block aligned)
+ *     face     uint32 [faceCount + 1], offsets into the index block
+ *     index    uint32 [indexCount], vertex of each face corner
+ *     material uint32 [faceCount]
+ *     normal   float nx[faceCount], ny[faceCount], nz[faceCount] (each block aligned)
+ */
+typedef struct
+{
+	char magic[4];
+	uint32_t byteOrder;
+	uint32_t vertexCount;
+	uint32_t faceCount;
+	uint32_t indexCount;
+	uint32_t flags;
+	uint64_t vertexOffset;
+	uint64_t faceOffset;
+	uint64_t indexOffset;
+	uint64_t materialOffset;
+	uint64_t normalOffset;
+} LffHeader;
+
+const char LFF_MAGIC[4] = {'L', 'F', 'F', '1'};
+
+typedef struct
+{
+	const char *data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE map;
+#else
+	int fd;
+#endif
+} MappedFile;
+
+/*
+ * Node of a bounding volume hierarchy over the faces of a mesh: the box of
+ * the faces of its subtree, faces[first] .. faces[first + count - 1] of the
+ * Bvh, and the vertices they use, vertices[firstVertex] onwards (vertexCount
+ * entries, unique within each leaf). An inner node is followed by its left
+ * child; right is the index of the other one, 0 in leaves.
+ */
+typedef struct
+{
+	float lo[3], hi[3];
+	int first, count;
+	int firstVertex, vertexCount;
+	int right;
+} BvhNode;
+
+typedef struct
+{
+	vector<BvhNode> nodes;
+	vector<int> faces, vertices;
+} Bvh;
+
+/*
+ * Indexed polygon mesh, stored as structure of arrays. Unique vertex j is
+ * (x[j], y[j], z[j]); face i has corners idx[f[i]] .. idx[f[i + 1] - 1], unit
+ * normal (nx[i], ny[i], nz[i]) (taken from its first three corners) and
+ * material mat[i]. The arrays always point into a .lff image: either a mapped
+ * .lff file (file) or a heap copy built by the .raw loader (image). bvh, if
+ * not NULL, is built by buildBvh to render only what is in view.
+ */
+typedef struct
+{
+	int np;
+	int nf;
+	const float *x, *y, *z;
+	const int *f;
+	const int *idx;
+	const int *mat;
+	const float *nx, *ny, *nz;
+	MappedFile *file;
+	char *image;
+	size_t size;
+	Bvh *bvh;
+} Mesh3D;
+
+/*
+ * Mesh vertices after projection, one entry per unique vertex: (x, y) in
+ * pixels, z the depth used by the depth buffer and w the homogeneous
+ * coordinate the vertex was divided by. clipX and clipY are x and y before
+ * the division, which clipping works with; scale, centerX and centerY map
+ * them to the pixels of a width x height image. Vertices made by clipping
+ * are appended after those of the mesh. When a stereo pair is drawn from
+ * the buffer, eyeShift and eyeInvW0 are the shift and invW0 of projectEye
+ * for the eyes (at plus and minus eyeShift), so that culling keeps whatever
+ * either eye sees; eyeShift is 0 otherwise.
+ */
+typedef struct
+{
+	vector<float> x, y, z, w, clipX, clipY;
+	float scale, centerX, centerY;
+	int width, height;
+	float eyeShift, eyeInvW0;
+} VertexBuffer;
+
+/*
+ * Where a projected vertex lies relative to the view: behind the near plane
+ * w = NEAR_W, beyond a side of the image (by more than a pixel, so nothing
+ * near the border is lost to rounding) or outside the guard band, GUARD_BAND
+ * pixels around the image. Triangles inside the guard band are only
+ * scissored by the rasterizers; the rest are clipped.
+ */
+enum ClipCode
+{
+	CLIP_NEAR = 1,
+	CLIP_X_MIN = 2,
+	CLIP_X_MAX = 4,
+	CLIP_Y_MIN = 8,
+	CLIP_Y_MAX = 16,
+	CLIP_GUARD = 32
+};
+
+/*
+ * A triangle ready for rasterization: three indices into the VertexBuffer,
+ * the mesh face it came from and its final flat colour.
+ */
+typedef struct
+{
+	int v[3];
+	int face;
+	Color c;
+} Triangle;
+
+/*
+ * A triangle set up for the half-space rasterizer by setupEdges: its vertices
+ * (fx, fy, fz), wound counterclockwise on the screen, the edge functions
+ * A * x + B * y + C of its vertices snapped to 1/16 pixel, positive inside,
+ * with dx and dy their steps per pixel, and the pixels xmin .. xmax x ymin ..
+ * ymax its bounding box covers. small is set when every value of an 8x8
+ * block fits in 32 bits. Depth changes by dzdx and dzdy per pixel.
+ */
+typedef struct
+{
+	float fx[3], fy[3], fz[3];
+	int64_t A[3], B[3], C[3], dx[3], dy[3];
+	double dzdx, dzdy;
+	int xmin, xmax, ymin, ymax;
+	bool small;
+} EdgeSetup;
+
+/*
+ * Coarse depth buffer for occlusion culling (see projectVisible), a cell per
+ * 8x8 block of a width x height image. Bit 8 * j + i of mask is set once an
+ * occluder covers pixel (i, j) of the cell, as for blockCoverage, and from
+ * the start for pixels outside the image; zMax bounds the depth occluders
+ * left in the cell, so a full cell hides everything behind zMax. budget is
+ * how many more occluder triangles the frame may draw. tested, occluded and
+ * skipped count the boxes tested and hidden in the frame and the faces the
+ * hidden ones held; faces is scratch space.
+ */
+typedef struct
+{
+	int width, height, cols, rows;
+	vector<uint64_t> mask;
+	vector<float> zMax;
+	int budget;
+	int tested, occluded, skipped;
+	vector<int> faces;
+} Occlusion;
+
+/*
+ * Fixed set of worker threads fed by runThreadPool. Each call bumps
+ * generation to wake the workers; they pull job indices from next until
+ * count is reached and report back through done.
+ */
+typedef struct
+{
+	vector<thread> workers;
+	mutex lock;
+	condition_variable wake, idle;
+	function<void(int)> job;
+	atomic<int> next;
+	int count;
+	int done;
+	unsigned generation;
+	bool quit;
+} ThreadPool;
+
+/*
+ * Image file being written strip by strip (see openImageWriter). A PPM is
+ * written through the mapping map, its pixel rows starting at pixels. Y4M
+ * and raw RGB are video streams that take any number of frames; chroma holds
+ * the Cb and Cr planes of the Y4M frame being written.
+ */
+typedef struct
+{
+	ImageFormat format;
+	bool stored;
+	int w, h, strips;
+	FILE *out;
+	MappedFile *map;
+	uchar *pixels;
+	uint32_t adler;
+	vector<uchar> chroma;
+} ImageWriter;
+
+/*
+ * Hands finished rows of a canvas being rendered to a thread that encodes
+ * and writes them. pending counts the unfinished tiles of every tile row;
+ * the first finalRows rows of the image, from the top, are complete.
+ */
+typedef struct
+{
+	ImageWriter *writer;
+	Canvas *canvas;
+	thread consumer;
+	mutex lock;
+	condition_variable ready;
+	vector<int> pending;
+	int finalRows;
+} OutputPipe;
+
+/*
+ * How setupFrame and drawTriangles turn the mesh into pixels. With a pool
+ * the canvas is split into tiles rendered in parallel by the edge
+ * rasterizer. deferred rasterizes face ids into a visibility buffer and
+ * shades afterwards. With a pipe, tiles are reported to it as they are
+ * finished. occlusion, if not NULL, lets setupFrame skip parts of the mesh
+ * hidden behind nearer ones.
+ */
+typedef struct
+{
+	Rasterizer raster;
+	ThreadPool *pool;
+	bool sort;
+	bool deferred;
+	OutputPipe *pipe;
+	Occlusion *occlusion;
+} RenderOptions;
+
+enum PathType
+{
+	PATH_KEYFRAMES,
+	PATH_BEZIER,
+	PATH_HERMITE
+};
+
+/*
+ * Camera keyframes read from a .scene file (see cameraPathFromFile). For a
+ * curve, control holds its four geometry points and gives the position.
+ */
+typedef struct
+{
+	PathType type;
+	vector<Point3D> pos, dir, up;
+	vector<Point3D> control;
+	bool aim;
+	Point3D target;
+} CameraPath;
 
 void swap(int *, int *);
 
-Canvas *createCanvas(int, int);
-void canvasToPPM(Canvas *, const char *);
+MappedFile *mapFile(const char *);
+MappedFile *createMappedFile(const char *, size_t);
+void unmapFile(MappedFile *);
+Point3D pointDiff(Point3D, Point3D);
+Point3D cross3D(Point3D, Point3D);
+double magnitude(Point3D);
+
+Canvas *createCanvas(int, int, Layout);
+ImageFormat imageFormat(const char *);
+ImageWriter *openImageWriter(const char *, ImageFormat, bool, int, int);
+OutputPipe *startOutputPipe(Canvas *, ImageWriter *);
+void finishOutputPipe(OutputPipe *);
+bool closeImageWriter(ImageWriter *);
+void writeCanvasStrips(ImageWriter *, Canvas *, ThreadPool *);
+Canvas *acquireCanvas(CanvasPool *, int, int, Layout);
+void releaseCanvas(CanvasPool *, Canvas *);
+void destroyCanvasPool(CanvasPool *);
+void composeStereo(Canvas *, Canvas *, StereoMode, Canvas *);
+void putColor(uchar *, Color);
 void drawPixel(Canvas *, int, int, Color);
 void drawPixelZ(Canvas *, int, int, double, Color);
+void hizMark(Canvas *, int, int);
+float hizTileMax(Canvas *, int, int);
 void drawLine(Canvas *, int, int, int, int, Color);
 void drawTriangle(Canvas *, int, int, double, int, int, double, int, int, double, Color);
+void drawTriangleEdge(Canvas *, int, int, int, int, float, float, float, float, float, float, float, float, float, Color, int);
+void drawOccluder(Occlusion *, float, float, float, float, float, float, float, float, float);
+void createVisibilityBuffer(Canvas *);
+void clearTile(Canvas *, int, int);
+void pipeTileDone(OutputPipe *, int);
 
-Matrix *createMatrix(int r, int c)
+constexpr Vec4 multMat4Vec4(const Mat4 &a, const Vec4 &v)
 {
-	int i, j;
-	Matrix *m;
-	m = new Matrix;
-	m->val = new double*[r];
-	for (i = 0; i < r; i++)
+	return Vec4{a.m[0][0] * v.x + a.m[0][1] * v.y + a.m[0][2] * v.z + a.m[0][3] * v.w,
+		a.m[1][0] * v.x + a.m[1][1] * v.y + a.m[1][2] * v.z + a.m[1][3] * v.w,
+		a.m[2][0] * v.x + a.m[2][1] * v.y + a.m[2][2] * v.z + a.m[2][3] * v.w,
+		a.m[3][0] * v.x + a.m[3][1] * v.y + a.m[3][2] * v.z + a.m[3][3] * v.w};
+}
+
+constexpr float dotMat4(const Mat4 &a, const Mat4 &b, int i, int j)
+{
+	return a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j] + a.m[i][3] * b.m[3][j];
+}
+
+constexpr Mat4 multMat4(const Mat4 &a, const Mat4 &b)
+{
+	return Mat4{{{dotMat4(a, b, 0, 0), dotMat4(a, b, 0, 1), dotMat4(a, b, 0, 2), dotMat4(a, b, 0, 3)},
+		{dotMat4(a, b, 1, 0), dotMat4(a, b, 1, 1), dotMat4(a, b, 1, 2), dotMat4(a, b, 1, 3)},
+		{dotMat4(a, b, 2, 0), dotMat4(a, b, 2, 1), dotMat4(a, b, 2, 2), dotMat4(a, b, 2, 3)},
+		{dotMat4(a, b, 3, 0), dotMat4(a, b, 3, 1), dotMat4(a, b, 3, 2), dotMat4(a, b, 3, 3)}}};
+}
+
+constexpr Mat4 MAT4_IDENTITY = {{{1.0f, 0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 1.0f, 0.0f}, {0.0f, 0.0f, 0.0f, 1.0f}}};
+
+MappedFile *mapFile(const char *filename)
+{
+	MappedFile *mf;
+	mf = new MappedFile;
+	mf->data = NULL;
+	mf->size = 0;
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	mf->map = NULL;
+	mf->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (mf->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(mf->file, &size))
 	{
-		m->val[i] = new double[c];
-		for (j = 0; j < c; j++)
+		unmapFile(mf);
+		return NULL;
+	}
+	mf->size = (size_t)size.QuadPart;
+	if (mf->size > 0)
+	{
+		mf->map = CreateFileMappingA(mf->file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mf->map != NULL)
+		{
+			mf->data = (const char *)MapViewOfFile(mf->map, FILE_MAP_READ, 0, 0, 0);
+		}
+		if (mf->data == NULL)
 		{
-			m->val[i][j] = 0.0;
+			unmapFile(mf);
+			return NULL;
 		}
 	}
-	m->r = r;
-	m->c = c;
-	return m;
+#else
+	struct stat st;
+	void *data;
+	mf->fd = open(filename, O_RDONLY);
+	if (mf->fd < 0 || fstat(mf->fd, &st) != 0)
+	{
+		unmapFile(mf);
+		return NULL;
+	}
+	mf->size = (size_t)st.st_size;
+	if (mf->size > 0)
+	{
+		data = mmap(NULL, mf->size, PROT_READ, MAP_PRIVATE, mf->fd, 0);
+		if (data == MAP_FAILED)
+		{
+			mf->size = 0;
+			unmapFile(mf);
+			return NULL;
+		}
+		madvise(data, mf->size, MADV_SEQUENTIAL);
+		mf->data = (const char *)data;
+	}
+#endif
+	return mf;
 }
 
-Matrix *multMatrix(Matrix *a, Matrix *b)
+/*
+ * Creates (or truncates) filename with the given size and maps it for
+ * writing. The contents reach the file when it is unmapped.
+ */
+MappedFile *createMappedFile(const char *filename, size_t size)
 {
-	int i, j, k, l;
-	Matrix *c;
-	if (a->c != b->r)
+	MappedFile *mf;
+	mf = new MappedFile;
+	mf->data = NULL;
+	mf->size = size;
+#ifdef _WIN32
+	mf->map = NULL;
+	mf->file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (mf->file == INVALID_HANDLE_VALUE)
 	{
+		unmapFile(mf);
 		return NULL;
 	}
-	l = a->c;
-	c = createMatrix(a->r, b->c);
-	for (i = 0; i < c->r; i++)
+	mf->map = CreateFileMappingA(mf->file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+	if (mf->map != NULL)
 	{
-		for (j = 0; j < c->c; j++)
-		{
-			for (k = 0; k < l; k++)
-			{
-				c->val[i][j] += a->val[i][k] * b->val[k][j];
-			}
-		}
+		mf->data = (const char *)MapViewOfFile(mf->map, FILE_MAP_WRITE, 0, 0, size);
 	}
-	return c;
+	if (mf->data == NULL)
+	{
+		unmapFile(mf);
+		return NULL;
+	}
+#else
+	void *data;
+	mf->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (mf->fd < 0 || ftruncate(mf->fd, (off_t)size) != 0)
+	{
+		mf->size = 0;
+		unmapFile(mf);
+		return NULL;
+	}
+#ifdef MAP_POPULATE
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mf->fd, 0);
+#else
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mf->fd, 0);
+#endif
+	if (data == MAP_FAILED)
+	{
+		mf->size = 0;
+		unmapFile(mf);
+		return NULL;
+	}
+	mf->data = (const char *)data;
+#endif
+	return mf;
 }
 
-Matrix *point3DToMatrix(Point3D p)
+void unmapFile(MappedFile *mf)
 {
-	Matrix *m;
-	m = createMatrix(4, 1);
-	m->val[0][0] = p.x;
-	m->val[1][0] = p.y;
-	m->val[2][0] = p.z;
-	m->val[3][0] = 1.0;
-	return m;
+#ifdef _WIN32
+	if (mf->data != NULL)
+		UnmapViewOfFile(mf->data);
+	if (mf->map != NULL)
+		CloseHandle(mf->map);
+	if (mf->file != INVALID_HANDLE_VALUE)
+		CloseHandle(mf->file);
+#else
+	if (mf->data != NULL)
+		munmap((void *)mf->data, mf->size);
+	if (mf->fd >= 0)
+		close(mf->fd);
+#endif
+	delete mf;
 }
 
-Map3D *openRawMap(const char *filename)
+/*
+ * Parses a decimal number in [*c, end) without going through the C locale.
+ * Numbers with up to 19 significant digits and a small exponent are converted
+ * exactly with a single multiplication or division by a power of ten; anything
+ * else falls back to strtod on a local copy of the token.
+ * Returns false (and leaves *c untouched) if no number starts at *c.
+ */
+bool parseDouble(const char **c, const char *end, double *out)
 {
-	FILE *fp;
-	Point3D *p;
-	Face3D *f;
-	Map3D *m;
-	double x;
-	char buffer[BUFFER_SIZE];
-	char *c;
-	fp = fopen(filename, "r");
-	m = new Map3D;
-	while (fgets(buffer, BUFFER_SIZE - 1, fp) != NULL)
-	{
-		f = new Face3D;
-		c = buffer;
-		while (true)
+	static const double POW10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+	const char *s;
+	unsigned long long m;
+	int digits, exp, e, esign;
+	bool neg, any;
+	char token[BUFFER_SIZE];
+	s = *c;
+	neg = false;
+	if (s < end && (*s == '-' || *s == '+'))
+	{
+		neg = (*s == '-');
+		s++;
+	}
+	m = 0;
+	digits = 0;
+	exp = 0;
+	any = false;
+	while (s < end && *s >= '0' && *s <= '9')
+	{
+		if (digits < 19)
+		{
+			m = m * 10 + (*s - '0');
+			if (m != 0)
+				digits++;
+		}
+		else
 		{
-			x = strtod(c, &c);
-			if (*(c + 1) == '\n')
+			exp++;
+			digits++;
+		}
+		any = true;
+		s++;
+	}
+	if (s < end && *s == '.')
+	{
+		s++;
+		while (s < end && *s >= '0' && *s <= '9')
+		{
+			if (digits < 19)
 			{
-				break;
+				m = m * 10 + (*s - '0');
+				exp--;
+				if (m != 0)
+					digits++;
+			}
+			else
+			{
+				digits++;
 			}
-			p = new Point3D;
-			p->x = x;
-			p->y = strtod(c, &c);
-			p->z = strtod(c, &c);
-			f->push_back(*p);
-		};
-		m->push_back(*f);
+			any = true;
+			s++;
+		}
 	}
-	return m;
-}
-
-Matrix *createIdentityMatrix(int l)
-{
-	int i;
-	Matrix *m;
-	m = createMatrix(l, l);
-	for (i = 0; i < l; i++)
+	if (!any)
 	{
-		m->val[i][i] = 1.0;
+		return false;
 	}
-	return m;
+	if (s < end && (*s == 'e' || *s == 'E'))
+	{
+		const char *t = s + 1;
+		esign = 1;
+		e = 0;
+		if (t < end && (*t == '-' || *t == '+'))
+		{
+			esign = (*t == '-') ? -1 : 1;
+			t++;
+		}
+		if (t < end && *t >= '0' && *t <= '9')
+		{
+			while (t < end && *t >= '0' && *t <= '9')
+			{
+				if (e < 10000)
+					e = e * 10 + (*t - '0');
+				t++;
+			}
+			exp += esign * e;
+			s = t;
+		}
+	}
+	if (digits <= 19 && m < (1ULL << 53) && exp >= -22 && exp <= 22)
+	{
+		*out = (exp < 0) ? (double)m / POW10[-exp] : (double)m * POW10[exp];
+	}
+	else
+	{
+		size_t len = s - *c;
+		if (len >= BUFFER_SIZE)
+			len = BUFFER_SIZE - 1;
+		memcpy(token, *c, len);
+		token[len] = '\0';
+		*out = strtod(token, NULL);
+		*c = s;
+		return true;
+	}
+	if (neg)
+		*out = -*out;
+	*c = s;
+	return true;
 }
 
-double dot3D(Point3D a, Point3D b)
+void *alignedAlloc(size_t size)
 {
-	return a.x * b.x + a.y * b.y + a.z * b.z;
+	void *p;
+#ifdef _WIN32
+	p = _aligned_malloc(size, LFF_ALIGN);
+#else
+	if (posix_memalign(&p, LFF_ALIGN, size) != 0)
+		p = NULL;
+#endif
+	return p;
 }
 
-Point3D cross3D(Point3D a, Point3D b)
+void alignedFree(void *p)
 {
-	Point3D c;
-	c.x = a.y * b.z - a.z * b.y;
-	c.y = a.z * b.x - a.x * b.z;
-	c.z = a.x * b.y - a.y * b.x;
-	return c;
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
 }
 
-Matrix *createProjectionMatrix(Point3D center, Point3D dir, Point3D up, double near, double far)
+size_t lffAlign(size_t n)
 {
-	Matrix *m, *t_1, *t_2;
-	Point3D p;
-	
-	t_1 = createIdentityMatrix(4);
-	t_1->val[0][3] = -center.x;
-	t_1->val[1][3] = -center.y;
-	t_1->val[2][3] = -center.z;
-	
-	p = cross3D(up, dir);
-	
-	t_2 = createMatrix(4, 4);
-	t_2->val[0][0] = p.x;
-	t_2->val[1][0] = up.x;
-	t_2->val[2][0] = dir.x;
-	t_2->val[0][1] = p.y;
-	t_2->val[1][1] = up.y;
-	t_2->val[2][1] = dir.y;
-	t_2->val[0][2] = p.z;
-	t_2->val[1][2] = up.z;
-	t_2->val[2][2] = dir.z;
-	t_2->val[3][3] = 1.0;
-	
-	m = multMatrix(t_2, t_1);
-	delete t_1;
-	delete t_2;
-	t_1 = m;
-	
-	t_2 = createMatrix(4, 4);
-	t_2->val[0][0] = near;
-	t_2->val[1][1] = near;
-	t_2->val[2][2] = near + far;
-	t_2->val[2][2] = -far * near;
-	t_2->val[3][2] = 1.0;
-	
-	m = multMatrix(t_2, t_1);
-	delete t_1;
-	delete t_2;
-	
-	return m;
+	return (n + LFF_ALIGN - 1) & ~(size_t)(LFF_ALIGN - 1);
 }
 
-void drawScaledLine(Canvas *canvas, double x_1, double y_1, double x_2, double y_2, double scale_1, double scale_2, Color c)
+/*
+ * Whether count elements of elementSize bytes from offset fit in an image of
+ * size bytes. The offset is checked first and the count compared by division,
+ * so no value read from a file can wrap the arithmetic.
+ */
+bool lffFits(uint64_t offset, uint64_t count, uint64_t elementSize, size_t size)
 {
-	drawLine(canvas, canvas->w / 2 + x_1 * scale_1, canvas->h / 2 + y_1 * scale_1, canvas->w / 2 + x_2 * scale_2, canvas->h / 2 + y_2 * scale_2, c);
+	if (offset > size)
+	{
+		return false;
+	}
+	return elementSize == 0 || count <= (size - offset) / elementSize;
 }
 
-void drawScaledTriangle(Canvas *canvas, double x_1, double y_1, double z_1, double x_2, double y_2, double z_2, double x_3, double y_3, double z_3, double scale_1, double scale_2, double scale_3, Color c)
+/*
+ * Fills in a .lff header for the given counts and returns the file size.
+ */
+size_t lffLayout(LffHeader *hd, int np, int nf, int ni)
 {
-	int mw = canvas->w / 2;
-	int mh = canvas->h / 2;
-	drawTriangle(canvas, mw + x_1 * scale_1, mh + y_1 * scale_1, z_1, mw + x_2 * scale_2, mh + y_2 * scale_2, z_2, mw + x_3 * scale_3, mh + y_3 * scale_3, z_3, c);
+	memset(hd, 0, sizeof(LffHeader));
+	memcpy(hd->magic, LFF_MAGIC, 4);
+	hd->byteOrder = LFF_BYTE_ORDER;
+	hd->vertexCount = np;
+	hd->faceCount = nf;
+	hd->indexCount = ni;
+	hd->vertexOffset = lffAlign(sizeof(LffHeader));
+	hd->faceOffset = hd->vertexOffset + 3 * lffAlign((size_t)np * sizeof(float));
+	hd->indexOffset = hd->faceOffset + lffAlign(((size_t)nf + 1) * sizeof(uint32_t));
+	hd->materialOffset = hd->indexOffset + lffAlign((size_t)ni * sizeof(uint32_t));
+	hd->normalOffset = hd->materialOffset + lffAlign((size_t)nf * sizeof(uint32_t));
+	return hd->normalOffset + 3 * lffAlign((size_t)nf * sizeof(float));
 }
 
-Point3D pointDiff(Point3D a, Point3D b)
+/*
+ * Points a mesh at a .lff image (mapped or in memory) without copying it.
+ * Blocks are validated against the image size and index ranges before use,
+ * so a truncated or foreign file yields NULL.
+ */
+Mesh3D *bindLffMap(const char *data, size_t size)
 {
-	Point3D c;
-	c.x = a.x - b.x;
-	c.y = a.y - b.y;
-	c.z = a.z - b.z;
-	return c;
+	LffHeader hd;
+	Mesh3D *m;
+	const uint32_t *face, *index;
+	size_t vBlock, nBlock;
+	uint32_t i;
+	if (size < sizeof(LffHeader))
+	{
+		return NULL;
+	}
+	memcpy(&hd, data, sizeof(LffHeader));
+	if (memcmp(hd.magic, LFF_MAGIC, 4) != 0 || hd.byteOrder != LFF_BYTE_ORDER || hd.vertexCount > INT_MAX || hd.faceCount >= INT_MAX || hd.indexCount > INT_MAX)
+	{
+		return NULL;
+	}
+	if (hd.vertexOffset % LFF_ALIGN || hd.faceOffset % LFF_ALIGN || hd.indexOffset % LFF_ALIGN || hd.materialOffset % LFF_ALIGN || hd.normalOffset % LFF_ALIGN
+		|| !lffFits(hd.vertexOffset, hd.vertexCount, sizeof(float), size)
+		|| !lffFits(hd.normalOffset, hd.faceCount, sizeof(float), size))
+	{
+		return NULL;
+	}
+	vBlock = lffAlign((size_t)hd.vertexCount * sizeof(float));
+	nBlock = lffAlign((size_t)hd.faceCount * sizeof(float));
+	if (!lffFits(hd.vertexOffset, 3, vBlock, size)
+		|| !lffFits(hd.faceOffset, (uint64_t)hd.faceCount + 1, sizeof(uint32_t), size)
+		|| !lffFits(hd.indexOffset, hd.indexCount, sizeof(uint32_t), size)
+		|| !lffFits(hd.materialOffset, hd.faceCount, sizeof(uint32_t), size)
+		|| !lffFits(hd.normalOffset, 3, nBlock, size))
+	{
+		return NULL;
+	}
+	face = (const uint32_t *)(data + hd.faceOffset);
+	index = (const uint32_t *)(data + hd.indexOffset);
+	if (face[0] != 0 || face[hd.faceCount] != hd.indexCount)
+	{
+		return NULL;
+	}
+	for (i = 0; i < hd.faceCount; i++)
+	{
+		if (face[i + 1] < face[i])
+			return NULL;
+	}
+	for (i = 0; i < hd.indexCount; i++)
+	{
+		if (index[i] >= hd.vertexCount)
+			return NULL;
+	}
+	m = new Mesh3D;
+	m->np = hd.vertexCount;
+	m->nf = hd.faceCount;
+	m->x = (const float *)(data + hd.vertexOffset);
+	m->y = (const float *)(data + hd.vertexOffset + vBlock);
+	m->z = (const float *)(data + hd.vertexOffset + 2 * vBlock);
+	m->f = (const int *)face;
+	m->idx = (const int *)index;
+	m->mat = (const int *)(data + hd.materialOffset);
+	m->nx = (const float *)(data + hd.normalOffset);
+	m->ny = (const float *)(data + hd.normalOffset + nBlock);
+	m->nz = (const float *)(data + hd.normalOffset + 2 * nBlock);
+	m->file = NULL;
+	m->image = NULL;
+	m->size = size;
+	m->bvh = NULL;
+	return m;
+}
+
+uint64_t weldKey(int64_t x, int64_t y, int64_t z)
+{
+	return (uint64_t)x * 73856093ULL ^ (uint64_t)y * 19349663ULL ^ (uint64_t)z * 83492791ULL;
+}
+
+/*
+ * Grid cell of coordinate v for cells of size eps. The cell number is clamped
+ * to +-2^62 (NaN goes to the low end) so that converting it is defined for
+ * any eps and coordinate; cells past the clamp only share a key, and corners
+ * are still compared by distance.
+ */
+int64_t weldCell(float v, double eps)
+{
+	const double LIMIT = 4611686018427387904.0;
+	double q;
+	q = floor(v / eps);
+	if (!(q >= -LIMIT))
+		return -(int64_t)LIMIT;
+	if (q > LIMIT)
+		return (int64_t)LIMIT;
+	return (int64_t)q;
+}
+
+/*
+ * Merges face corners into a pool of unique vertices. Two corners are the same
+ * vertex when they differ by at most eps on every axis (eps = 0 merges exact
+ * matches only). Vertices are hashed by grid cell of size eps, so a corner is
+ * only compared against the vertices of its 27 neighbouring cells.
+ */
+void weldVertices(const vector<float> &cx, const vector<float> &cy, const vector<float> &cz, double eps, vector<float> *px, vector<float> *py, vector<float> *pz, vector<int> *idx)
+{
+	unordered_map<uint64_t, int> head;
+	unordered_map<uint64_t, int>::iterator it;
+	vector<int> next;
+	int64_t ix, iy, iz;
+	uint64_t key, own;
+	size_t i;
+	int j, found, dx, dy, dz;
+	float x, y, z;
+	uint32_t b[3];
+	head.reserve(cx.size());
+	idx->resize(cx.size());
+	for (i = 0; i < cx.size(); i++)
+	{
+		x = cx[i] + 0.0f;
+		y = cy[i] + 0.0f;
+		z = cz[i] + 0.0f;
+		found = -1;
+		if (eps <= 0.0)
+		{
+			memcpy(&b[0], &x, 4);
+			memcpy(&b[1], &y, 4);
+			memcpy(&b[2], &z, 4);
+			own = weldKey(b[0], b[1], b[2]);
+			it = head.find(own);
+			for (j = (it == head.end()) ? -1 : it->second; j >= 0 && found < 0; j = next[j])
+			{
+				if ((*px)[j] == x && (*py)[j] == y && (*pz)[j] == z)
+					found = j;
+			}
+		}
+		else
+		{
+			ix = weldCell(x, eps);
+			iy = weldCell(y, eps);
+			iz = weldCell(z, eps);
+			own = weldKey(ix, iy, iz);
+			for (dx = -1; dx <= 1 && found < 0; dx++)
+				for (dy = -1; dy <= 1 && found < 0; dy++)
+					for (dz = -1; dz <= 1 && found < 0; dz++)
+					{
+						key = weldKey(ix + dx, iy + dy, iz + dz);
+						it = head.find(key);
+						for (j = (it == head.end()) ? -1 : it->second; j >= 0 && found < 0; j = next[j])
+						{
+							if (fabs((*px)[j] - x) <= eps && fabs((*py)[j] - y) <= eps && fabs((*pz)[j] - z) <= eps)
+								found = j;
+						}
+					}
+		}
+		if (found < 0)
+		{
+			found = (int)px->size();
+			px->push_back(x);
+			py->push_back(y);
+			pz->push_back(z);
+			it = head.find(own);
+			next.push_back((it == head.end()) ? -1 : it->second);
+			head[own] = found;
+		}
+		(*idx)[i] = found;
+	}
+}
+
+/*
+ * Lays out an indexed mesh as an in-memory .lff image, computing face normals
+ * and default materials (face i uses material i), and binds a mesh to it.
+ * Returns NULL if there is no memory for the image.
+ */
+Mesh3D *buildMesh(const vector<float> &px, const vector<float> &py, const vector<float> &pz, const vector<int> &f, const vector<int> &idx)
+{
+	LffHeader hd;
+	Mesh3D *m;
+	Point3D a, b, c, n;
+	char *image;
+	float *nx, *ny, *nz;
+	uint32_t *mat;
+	size_t size, vBlock, nBlock;
+	int i, np, nf, ni;
+	double l;
+	np = (int)px.size();
+	nf = (int)f.size() - 1;
+	ni = (int)idx.size();
+	size = lffLayout(&hd, np, nf, ni);
+	image = (char *)alignedAlloc(size);
+	if (image == NULL)
+	{
+		return NULL;
+	}
+	memset(image, 0, size);
+	memcpy(image, &hd, sizeof(hd));
+	vBlock = lffAlign((size_t)np * sizeof(float));
+	nBlock = lffAlign((size_t)nf * sizeof(float));
+	memcpy(image + hd.vertexOffset, px.data(), np * sizeof(float));
+	memcpy(image + hd.vertexOffset + vBlock, py.data(), np * sizeof(float));
+	memcpy(image + hd.vertexOffset + 2 * vBlock, pz.data(), np * sizeof(float));
+	memcpy(image + hd.faceOffset, f.data(), (nf + 1) * sizeof(uint32_t));
+	memcpy(image + hd.indexOffset, idx.data(), ni * sizeof(uint32_t));
+	mat = (uint32_t *)(image + hd.materialOffset);
+	nx = (float *)(image + hd.normalOffset);
+	ny = (float *)(image + hd.normalOffset + nBlock);
+	nz = (float *)(image + hd.normalOffset + 2 * nBlock);
+	for (i = 0; i < nf; i++)
+	{
+		mat[i] = i;
+		if (f[i + 1] - f[i] < 3)
+		{
+			continue;
+		}
+		a.x = px[idx[f[i]]];
+		a.y = py[idx[f[i]]];
+		a.z = pz[idx[f[i]]];
+		b.x = px[idx[f[i] + 1]];
+		b.y = py[idx[f[i] + 1]];
+		b.z = pz[idx[f[i] + 1]];
+		c.x = px[idx[f[i] + 2]];
+		c.y = py[idx[f[i] + 2]];
+		c.z = pz[idx[f[i] + 2]];
+		n = cross3D(pointDiff(a, b), pointDiff(a, c));
+		l = magnitude(n);
+		if (l > 0.0)
+		{
+			nx[i] = n.x / l;
+			ny[i] = n.y / l;
+			nz[i] = n.z / l;
+		}
+	}
+	m = bindLffMap(image, size);
+	if (m == NULL)
+	{
+		alignedFree(image);
+		return NULL;
+	}
+	m->image = image;
+	return m;
+}
+
+Mesh3D *parseRawMap(const char *data, size_t size, double eps)
+{
+	vector<float> cx, cy, cz, px, py, pz;
+	vector<int> f, idx;
+	double v[3];
+	const char *c, *end, *eol;
+	int n;
+	c = data;
+	end = data + size;
+	cx.reserve(size / 27);
+	cy.reserve(size / 27);
+	cz.reserve(size / 27);
+	f.reserve(size / 81 + 1);
+	f.push_back(0);
+	while (c < end)
+	{
+		eol = (const char *)memchr(c, '\n', end - c);
+		if (eol == NULL)
+			eol = end;
+		n = 0;
+		while (true)
+		{
+			while (c < eol && (*c == ' ' || *c == '\t' || *c == '\r'))
+				c++;
+			if (c == eol || !parseDouble(&c, eol, &v[n]))
+				break;
+			if (++n == 3)
+			{
+				cx.push_back((float)v[0]);
+				cy.push_back((float)v[1]);
+				cz.push_back((float)v[2]);
+				n = 0;
+			}
+		}
+		if ((int)cx.size() != f.back())
+		{
+			f.push_back((int)cx.size());
+		}
+		c = eol + 1;
+	}
+	weldVertices(cx, cy, cz, eps, &px, &py, &pz, &idx);
+	return buildMesh(px, py, pz, f, idx);
+}
+
+/*
+ * Opens a mesh file, either compiled (.lff, recognized by its magic number and
+ * used in place) or plain text (.raw, welded with tolerance eps).
+ */
+Mesh3D *openMap(const char *filename, double eps)
+{
+	MappedFile *mf;
+	Mesh3D *m;
+	mf = mapFile(filename);
+	if (mf == NULL)
+	{
+		return NULL;
+	}
+	if (mf->size >= 4 && memcmp(mf->data, LFF_MAGIC, 4) == 0)
+	{
+		m = bindLffMap(mf->data, mf->size);
+		if (m == NULL)
+		{
+			fprintf(stderr, "%s: invalid .lff file\n", filename);
+			unmapFile(mf);
+			return NULL;
+		}
+		m->file = mf;
+		return m;
+	}
+	m = parseRawMap(mf->data, mf->size, eps);
+	unmapFile(mf);
+	if (m == NULL)
+	{
+		fprintf(stderr, "%s: mesh too large for memory\n", filename);
+	}
+	return m;
+}
+
+void freeMesh3D(Mesh3D *m)
+{
+	if (m->file != NULL)
+		unmapFile(m->file);
+	if (m->image != NULL)
+		alignedFree(m->image);
+	delete m->bvh;
+	delete m;
+}
+
+/*
+ * Writes a mesh as a .lff file. The mesh already lives in a .lff image, so
+ * this is a single write.
+ */
+bool saveLffMap(Mesh3D *m, const char *filename)
+{
+	FILE *out;
+	const char *data;
+	size_t written;
+	data = (m->file != NULL) ? m->file->data : m->image;
+	out = fopen(filename, "wb");
+	if (out == NULL)
+	{
+		return false;
+	}
+	written = fwrite(data, 1, m->size, out);
+	return (fclose(out) == 0) && written == m->size;
+}
+
+double dot3D(Point3D a, Point3D b)
+{
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+Point3D cross3D(Point3D a, Point3D b)
+{
+	Point3D c;
+	c.x = a.y * b.z - a.z * b.y;
+	c.y = a.z * b.x - a.x * b.z;
+	c.z = a.x * b.y - a.y * b.x;
+	return c;
+}
+
+Mat4 createProjectionMatrix(Point3D center, Point3D dir, Point3D up, double near, double far)
+{
+	Mat4 t_1, t_2, m;
+	Point3D p;
+	
+	t_1 = MAT4_IDENTITY;
+	t_1.m[0][3] = -center.x;
+	t_1.m[1][3] = -center.y;
+	t_1.m[2][3] = -center.z;
+	
+	p = cross3D(up, dir);
+	
+	t_2 = MAT4_IDENTITY;
+	t_2.m[0][0] = p.x;
+	t_2.m[1][0] = up.x;
+	t_2.m[2][0] = dir.x;
+	t_2.m[0][1] = p.y;
+	t_2.m[1][1] = up.y;
+	t_2.m[2][1] = dir.y;
+	t_2.m[0][2] = p.z;
+	t_2.m[1][2] = up.z;
+	t_2.m[2][2] = dir.z;
+	
+	m = multMat4(t_2, t_1);
+	
+	t_2 = Mat4();
+	t_2.m[0][0] = near;
+	t_2.m[1][1] = near;
+	t_2.m[2][2] = -far * near;
+	t_2.m[3][2] = 1.0;
+	
+	return multMat4(t_2, m);
+}
+
+Point3D pointDiff(Point3D a, Point3D b)
+{
+	Point3D c;
+	c.x = a.x - b.x;
+	c.y = a.y - b.y;
+	c.z = a.z - b.z;
+	return c;
 }
 
 double magnitude(Point3D a)
 {
-	return sqrt(a.x * a.x + a.y * a.y + a.z * a.z);
+	return sqrt(a.x * a.x + a.y * a.y + a.z * a.z);
+}
+
+/*
+ * Centre of the bounding box of the mesh.
+ */
+Point3D meshCenter(Mesh3D *m)
+{
+	Point3D lo, hi, c;
+	int j;
+	lo.x = lo.y = lo.z = numeric_limits<double>::max();
+	hi.x = hi.y = hi.z = -numeric_limits<double>::max();
+	for (j = 0; j < m->np; j++)
+	{
+		lo.x = min(lo.x, (double)m->x[j]);
+		lo.y = min(lo.y, (double)m->y[j]);
+		lo.z = min(lo.z, (double)m->z[j]);
+		hi.x = max(hi.x, (double)m->x[j]);
+		hi.y = max(hi.y, (double)m->y[j]);
+		hi.z = max(hi.z, (double)m->z[j]);
+	}
+	c.x = (lo.x + hi.x) / 2;
+	c.y = (lo.y + hi.y) / 2;
+	c.z = (lo.z + hi.z) / 2;
+	return c;
+}
+
+/*
+ * Builds the subtree of bvh over faces[first] .. faces[last - 1], whose
+ * boxes are box[6 * i] .. box[6 * i + 5] (low then high corner), and returns
+ * the index of its root. Inner nodes split their faces in halves at the
+ * median of the box centres along the longest axis of the centres' bounds.
+ */
+int buildBvhNode(Mesh3D *m, Bvh *bvh, const vector<float> &box, int first, int last)
+{
+	BvhNode node;
+	float clo[3], chi[3], c;
+	int i, k, axis, mid, self;
+	int *faces;
+	const int *corner;
+	faces = bvh->faces.data();
+	for (k = 0; k < 3; k++)
+	{
+		node.lo[k] = clo[k] = numeric_limits<float>::max();
+		node.hi[k] = chi[k] = -numeric_limits<float>::max();
+	}
+	for (i = first; i < last; i++)
+	{
+		for (k = 0; k < 3; k++)
+		{
+			node.lo[k] = min(node.lo[k], box[6 * faces[i] + k]);
+			node.hi[k] = max(node.hi[k], box[6 * faces[i] + 3 + k]);
+			c = box[6 * faces[i] + k] + box[6 * faces[i] + 3 + k];
+			clo[k] = min(clo[k], c);
+			chi[k] = max(chi[k], c);
+		}
+	}
+	node.first = first;
+	node.count = last - first;
+	node.firstVertex = (int)bvh->vertices.size();
+	node.right = 0;
+	self = (int)bvh->nodes.size();
+	bvh->nodes.push_back(node);
+	if (last - first <= BVH_LEAF)
+	{
+		for (i = first; i < last; i++)
+		{
+			corner = m->idx + m->f[faces[i]];
+			bvh->vertices.insert(bvh->vertices.end(), corner, m->idx + m->f[faces[i] + 1]);
+		}
+		sort(bvh->vertices.begin() + node.firstVertex, bvh->vertices.end());
+		bvh->vertices.erase(unique(bvh->vertices.begin() + node.firstVertex, bvh->vertices.end()), bvh->vertices.end());
+	}
+	else
+	{
+		axis = 0;
+		for (k = 1; k < 3; k++)
+		{
+			if (chi[k] - clo[k] > chi[axis] - clo[axis])
+				axis = k;
+		}
+		mid = (first + last) / 2;
+		nth_element(faces + first, faces + mid, faces + last, [&](int a, int b) {
+			return box[6 * a + axis] + box[6 * a + 3 + axis] < box[6 * b + axis] + box[6 * b + 3 + axis];
+		});
+		buildBvhNode(m, bvh, box, first, mid);
+		k = buildBvhNode(m, bvh, box, mid, last);
+		bvh->nodes[self].right = k;
+	}
+	bvh->nodes[self].vertexCount = (int)bvh->vertices.size() - bvh->nodes[self].firstVertex;
+	return self;
+}
+
+/*
+ * Bounding volume hierarchy over the faces of m that have at least three
+ * corners, with at most BVH_LEAF faces per leaf.
+ */
+Bvh *buildBvh(Mesh3D *m)
+{
+	Bvh *bvh;
+	vector<float> box;
+	int i, j, k, v;
+	bvh = new Bvh;
+	box.resize(6 * (size_t)m->nf);
+	for (i = 0; i < m->nf; i++)
+	{
+		if (m->f[i + 1] - m->f[i] < 3)
+			continue;
+		bvh->faces.push_back(i);
+		for (k = 0; k < 3; k++)
+		{
+			box[6 * i + k] = numeric_limits<float>::max();
+			box[6 * i + 3 + k] = -numeric_limits<float>::max();
+		}
+		for (j = m->f[i]; j < m->f[i + 1]; j++)
+		{
+			v = m->idx[j];
+			box[6 * i] = min(box[6 * i], m->x[v]);
+			box[6 * i + 1] = min(box[6 * i + 1], m->y[v]);
+			box[6 * i + 2] = min(box[6 * i + 2], m->z[v]);
+			box[6 * i + 3] = max(box[6 * i + 3], m->x[v]);
+			box[6 * i + 4] = max(box[6 * i + 4], m->y[v]);
+			box[6 * i + 5] = max(box[6 * i + 5], m->z[v]);
+		}
+	}
+	if (!bvh->faces.empty())
+	{
+		buildBvhNode(m, bvh, box, 0, (int)bvh->faces.size());
+	}
+	return bvh;
+}
+
+/*
+ * Rotates p by angle radians around the unit vector axis.
+ */
+Point3D rotateAbout(Point3D p, Point3D axis, double angle)
+{
+	Point3D c, r;
+	double s, k, d;
+	s = sin(angle);
+	k = cos(angle);
+	c = cross3D(axis, p);
+	d = dot3D(axis, p) * (1.0 - k);
+	r.x = p.x * k + c.x * s + axis.x * d;
+	r.y = p.y * k + c.y * s + axis.y * d;
+	r.z = p.z * k + c.z * s + axis.z * d;
+	return r;
+}
+
+Point3D meshPoint(Mesh3D *m, int j)
+{
+	Point3D p;
+	p.x = m->x[j];
+	p.y = m->y[j];
+	p.z = m->z[j];
+	return p;
+}
+
+Point3D meshNormal(Mesh3D *m, int i)
+{
+	Point3D n;
+	n.x = m->nx[i];
+	n.y = m->ny[i];
+	n.z = m->nz[i];
+	return n;
+}
+
+/*
+ * Sizes vb for the vertices of map and sets how they map to the pixels of a
+ * width x height image, for a single view.
+ */
+void setupVertexBuffer(Mesh3D *map, double scale, int width, int height, VertexBuffer *vb)
+{
+	int n;
+	n = map->np;
+	vb->x.resize(n);
+	vb->y.resize(n);
+	vb->z.resize(n);
+	vb->w.resize(n);
+	vb->clipX.resize(n);
+	vb->clipY.resize(n);
+	vb->scale = (float)scale;
+	vb->centerX = (float)(width / 2);
+	vb->centerY = (float)(height / 2);
+	vb->width = width;
+	vb->height = height;
+	vb->eyeShift = 0.0f;
+	vb->eyeInvW0 = 0.0f;
+}
+
+/*
+ * Projects vertex j of map into vb; the vector paths of projectMesh round
+ * exactly like this.
+ */
+inline void projectVertex(Mesh3D *map, const Mat4 &t, VertexBuffer *vb, int j)
+{
+	float X, Y, Z, W, k;
+	X = t.m[0][0] * map->x[j] + t.m[0][1] * map->y[j] + t.m[0][2] * map->z[j] + t.m[0][3];
+	Y = t.m[1][0] * map->x[j] + t.m[1][1] * map->y[j] + t.m[1][2] * map->z[j] + t.m[1][3];
+	Z = t.m[2][0] * map->x[j] + t.m[2][1] * map->y[j] + t.m[2][2] * map->z[j] + t.m[2][3];
+	W = t.m[3][0] * map->x[j] + t.m[3][1] * map->y[j] + t.m[3][2] * map->z[j] + t.m[3][3];
+	k = vb->scale / W;
+	vb->x[j] = vb->centerX + X * k;
+	vb->y[j] = vb->centerY + Y * k;
+	vb->z[j] = Z;
+	vb->w[j] = W;
+	vb->clipX[j] = X;
+	vb->clipY[j] = Y;
+}
+
+/*
+ * Projects every unique vertex of the mesh to the screen: applies t, divides
+ * by w and maps to pixel coordinates around the center of a width x height
+ * canvas. Faces then gather their screen-space corners by index. The mesh is
+ * processed 8 (AVX) or 4 (SSE2) vertices at a time straight from its
+ * structure-of-arrays layout; all paths round exactly like the scalar tail.
+ */
+void projectMesh(Mesh3D *map, const Mat4 &t, double scale, int width, int height, VertexBuffer *vb)
+{
+	int j, n;
+	float s, cx, cy;
+	float *ox, *oy, *oz, *ow, *qx, *qy;
+	n = map->np;
+	setupVertexBuffer(map, scale, width, height, vb);
+	ox = vb->x.data();
+	oy = vb->y.data();
+	oz = vb->z.data();
+	ow = vb->w.data();
+	qx = vb->clipX.data();
+	qy = vb->clipY.data();
+	s = vb->scale;
+	cx = vb->centerX;
+	cy = vb->centerY;
+	j = 0;
+#ifdef USE_AVX
+	{
+		__m256 m[4][4], vx, vy, vz, rx, ry, rz, rw, rk;
+		__m256 vs = _mm256_set1_ps(s), vcx = _mm256_set1_ps(cx), vcy = _mm256_set1_ps(cy);
+		int r, c;
+		for (r = 0; r < 4; r++)
+			for (c = 0; c < 4; c++)
+				m[r][c] = _mm256_set1_ps(t.m[r][c]);
+		for (; j + 8 <= n; j += 8)
+		{
+			vx = _mm256_loadu_ps(map->x + j);
+			vy = _mm256_loadu_ps(map->y + j);
+			vz = _mm256_loadu_ps(map->z + j);
+			rx = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[0][0], vx), _mm256_mul_ps(m[0][1], vy)), _mm256_mul_ps(m[0][2], vz)), m[0][3]);
+			ry = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[1][0], vx), _mm256_mul_ps(m[1][1], vy)), _mm256_mul_ps(m[1][2], vz)), m[1][3]);
+			rz = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[2][0], vx), _mm256_mul_ps(m[2][1], vy)), _mm256_mul_ps(m[2][2], vz)), m[2][3]);
+			rw = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[3][0], vx), _mm256_mul_ps(m[3][1], vy)), _mm256_mul_ps(m[3][2], vz)), m[3][3]);
+			rk = _mm256_div_ps(vs, rw);
+			_mm256_storeu_ps(ox + j, _mm256_add_ps(vcx, _mm256_mul_ps(rx, rk)));
+			_mm256_storeu_ps(oy + j, _mm256_add_ps(vcy, _mm256_mul_ps(ry, rk)));
+			_mm256_storeu_ps(oz + j, rz);
+			_mm256_storeu_ps(ow + j, rw);
+			_mm256_storeu_ps(qx + j, rx);
+			_mm256_storeu_ps(qy + j, ry);
+		}
+	}
+#endif
+#ifdef USE_SSE2
+	{
+		__m128 m[4][4], vx, vy, vz, rx, ry, rz, rw, rk;
+		__m128 vs = _mm_set1_ps(s), vcx = _mm_set1_ps(cx), vcy = _mm_set1_ps(cy);
+		int r, c;
+		for (r = 0; r < 4; r++)
+			for (c = 0; c < 4; c++)
+				m[r][c] = _mm_set1_ps(t.m[r][c]);
+		for (; j + 4 <= n; j += 4)
+		{
+			vx = _mm_loadu_ps(map->x + j);
+			vy = _mm_loadu_ps(map->y + j);
+			vz = _mm_loadu_ps(map->z + j);
+			rx = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0][0], vx), _mm_mul_ps(m[0][1], vy)), _mm_mul_ps(m[0][2], vz)), m[0][3]);
+			ry = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[1][0], vx), _mm_mul_ps(m[1][1], vy)), _mm_mul_ps(m[1][2], vz)), m[1][3]);
+			rz = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[2][0], vx), _mm_mul_ps(m[2][1], vy)), _mm_mul_ps(m[2][2], vz)), m[2][3]);
+			rw = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[3][0], vx), _mm_mul_ps(m[3][1], vy)), _mm_mul_ps(m[3][2], vz)), m[3][3]);
+			rk = _mm_div_ps(vs, rw);
+			_mm_storeu_ps(ox + j, _mm_add_ps(vcx, _mm_mul_ps(rx, rk)));
+			_mm_storeu_ps(oy + j, _mm_add_ps(vcy, _mm_mul_ps(ry, rk)));
+			_mm_storeu_ps(oz + j, rz);
+			_mm_storeu_ps(ow + j, rw);
+			_mm_storeu_ps(qx + j, rx);
+			_mm_storeu_ps(qy + j, ry);
+		}
+	}
+#endif
+	for (; j < n; j++)
+	{
+		projectVertex(map, t, vb, j);
+	}
+}
+
+/*
+ * Projects only vertices list[0] .. list[n - 1] into vb, which
+ * setupVertexBuffer has prepared; the rest keep whatever they held.
+ */
+void projectVertices(Mesh3D *map, const Mat4 &t, const int *list, int n, VertexBuffer *vb)
+{
+	int i;
+	for (i = 0; i < n; i++)
+	{
+		projectVertex(map, t, vb, list[i]);
+	}
+}
+
+/*
+ * ClipCode flags of vertex j of vb. With a stereo pair a vertex is only
+ * beyond a side of the image if it is for both eyes, and only the top and
+ * bottom of the guard band count: x differs between the eyes, which are
+ * clipped against their own sides once projectEye has made them.
+ */
+int clipCode(VertexBuffer *vb, int j)
+{
+	int code;
+	float x, y, spread;
+	if (!(vb->w[j] >= NEAR_W))
+		return CLIP_NEAR;
+	x = vb->x[j];
+	y = vb->y[j];
+	spread = fabs(vb->eyeShift * (1.0f / vb->w[j] - vb->eyeInvW0));
+	code = 0;
+	if (x + spread < -1.0f)
+		code |= CLIP_X_MIN;
+	if (x - spread > vb->width + 1.0f)
+		code |= CLIP_X_MAX;
+	if (y < -1.0f)
+		code |= CLIP_Y_MIN;
+	if (y > vb->height + 1.0f)
+		code |= CLIP_Y_MAX;
+	if (vb->eyeShift == 0.0f && !(x >= -GUARD_BAND && x <= vb->width + GUARD_BAND))
+		code |= CLIP_GUARD;
+	if (!(y >= -GUARD_BAND && y <= vb->height + GUARD_BAND))
+		code |= CLIP_GUARD;
+	return code;
+}
+
+/*
+ * Homogeneous vertex j of vb.
+ */
+Vec4 clipVertex(VertexBuffer *vb, int j)
+{
+	Vec4 p;
+	p.x = vb->clipX[j];
+	p.y = vb->clipY[j];
+	p.z = vb->z[j];
+	p.w = vb->w[j];
+	return p;
+}
+
+/*
+ * Signed distance, positive inside, of homogeneous point p to clip plane k:
+ * 0 is the near plane and 1 to 4 the sides of the guard band. A side is
+ * w * (x - bound) with x the pixel p projects to, which is linear in p.
+ */
+float clipDistance(VertexBuffer *vb, Vec4 p, int k)
+{
+	switch (k)
+	{
+	case 0:
+		return p.w - NEAR_W;
+	case 1:
+		return vb->scale * p.x + (vb->centerX + GUARD_BAND) * p.w;
+	case 2:
+		return (vb->width + GUARD_BAND - vb->centerX) * p.w - vb->scale * p.x;
+	case 3:
+		return vb->scale * p.y + (vb->centerY + GUARD_BAND) * p.w;
+	default:
+		return (vb->height + GUARD_BAND - vb->centerY) * p.w - vb->scale * p.y;
+	}
+}
+
+Vec4 lerpVec4(Vec4 a, Vec4 b, float f)
+{
+	Vec4 p;
+	p.x = a.x + (b.x - a.x) * f;
+	p.y = a.y + (b.y - a.y) * f;
+	p.z = a.z + (b.z - a.z) * f;
+	p.w = a.w + (b.w - a.w) * f;
+	return p;
+}
+
+/*
+ * Appends the projection of homogeneous point p to vb, the way projectMesh
+ * projects mesh vertices, and returns its index.
+ */
+int addClipVertex(VertexBuffer *vb, Vec4 p)
+{
+	float k;
+	k = vb->scale / p.w;
+	vb->x.push_back(vb->centerX + p.x * k);
+	vb->y.push_back(vb->centerY + p.y * k);
+	vb->z.push_back(p.z);
+	vb->w.push_back(p.w);
+	vb->clipX.push_back(p.x);
+	vb->clipY.push_back(p.y);
+	return (int)vb->x.size() - 1;
+}
+
+/*
+ * Clips the convex polygon p of n homogeneous vertices against the near
+ * plane and the guard band, one plane after another (Sutherland-Hodgman).
+ * For a stereo pair the left and right sides are skipped, as in clipCode.
+ * src[i] is the vb index of p[i], or -1 for a vertex made by clipping.
+ * Returns how many vertices are left; p and src hold CLIP_MAX entries.
+ */
+int clipPolygon(VertexBuffer *vb, Vec4 *p, int *src, int n)
+{
+	Vec4 q[CLIP_MAX];
+	int qs[CLIP_MAX];
+	int i, k, m, next;
+	float d[CLIP_MAX];
+	for (k = 0; k < 5 && n > 0; k++)
+	{
+		if (vb->eyeShift != 0.0f && (k == 1 || k == 2))
+			continue;
+		for (i = 0; i < n; i++)
+			d[i] = clipDistance(vb, p[i], k);
+		m = 0;
+		for (i = 0; i < n; i++)
+		{
+			next = (i + 1) % n;
+			if (d[i] >= 0.0f)
+			{
+				q[m] = p[i];
+				qs[m++] = src[i];
+			}
+			if ((d[i] >= 0.0f) != (d[next] >= 0.0f))
+			{
+				q[m] = lerpVec4(p[i], p[next], d[i] / (d[i] - d[next]));
+				qs[m++] = -1;
+			}
+		}
+		for (i = 0; i < m; i++)
+		{
+			p[i] = q[i];
+			src[i] = qs[i];
+		}
+		n = m;
+	}
+	return n;
+}
+
+/*
+ * Homogeneous x, y and w of the first three corners of face i, for lane l of
+ * lanes: element k of the nine rows is at g[k * lanes + l]. Faces with fewer
+ * corners get zeros, which cullFaces treats as back facing.
+ */
+inline void gatherFace(Mesh3D *map, VertexBuffer *vb, int i, float *g, int lanes, int l)
+{
+	const int *corner;
+	int k;
+	if (map->f[i + 1] - map->f[i] < 3)
+	{
+		for (k = 0; k < 9; k++)
+			g[k * lanes + l] = 0.0f;
+		return;
+	}
+	corner = map->idx + map->f[i];
+	for (k = 0; k < 3; k++)
+	{
+		g[(3 * k) * lanes + l] = vb->clipX[corner[k]];
+		g[(3 * k + 1) * lanes + l] = vb->clipY[corner[k]];
+		g[(3 * k + 2) * lanes + l] = vb->w[corner[k]];
+	}
+}
+
+/*
+ * Back face culling on the projected mesh: stores in faces, in order, those
+ * of faces list[0] .. list[n - 1] (faces 0 .. n - 1 if list is NULL) whose
+ * first three corners wind front facing on the screen. The
+ * winding is the sign of the determinant of their homogeneous (x, y, w),
+ * negative for front faces with this projection. For corners in front of the
+ * camera it is the sign of the signed area on the screen, and it stays right
+ * for corners behind it, so culling runs before clipping. Every face is
+ * judged along the line of sight to it rather than along the view direction,
+ * as perspective requires. Faces are tested 8 (AVX) or 4 (SSE2) at a time;
+ * all paths compute the same products.
+ *
+ * For a stereo pair (eyeShift not 0) a face is kept if it faces either eye.
+ * projectEye adds a * (1 - eyeInvW0 * w), a = eyeShift / scale, to x; the w
+ * part leaves the determinant alone, so an eye's is det +- a * D1, D1 being
+ * the determinant with x replaced by 1, and the face is kept when
+ * det - |a * D1| < 0.
+ */
+void cullFaces(Mesh3D *map, VertexBuffer *vb, const int *list, int n, vector<int> *faces)
+{
+	int i, l, mask;
+	float g[72], det, a;
+	faces->clear();
+	a = fabs(vb->eyeShift / vb->scale);
+	i = 0;
+#ifdef USE_AVX
+	{
+		__m256 r[9], d, d1, sign;
+		sign = _mm256_set1_ps(-0.0f);
+		for (; i + 8 <= n; i += 8)
+		{
+			for (l = 0; l < 8; l++)
+				gatherFace(map, vb, list ? list[i + l] : i + l, g, 8, l);
+			for (l = 0; l < 9; l++)
+				r[l] = _mm256_loadu_ps(g + 8 * l);
+			d = _mm256_mul_ps(r[0], _mm256_sub_ps(_mm256_mul_ps(r[4], r[8]), _mm256_mul_ps(r[5], r[7])));
+			d = _mm256_sub_ps(d, _mm256_mul_ps(r[1], _mm256_sub_ps(_mm256_mul_ps(r[3], r[8]), _mm256_mul_ps(r[5], r[6]))));
+			d = _mm256_add_ps(d, _mm256_mul_ps(r[2], _mm256_sub_ps(_mm256_mul_ps(r[3], r[7]), _mm256_mul_ps(r[4], r[6]))));
+			if (a != 0.0f)
+			{
+				d1 = _mm256_sub_ps(_mm256_mul_ps(r[4], r[8]), _mm256_mul_ps(r[5], r[7]));
+				d1 = _mm256_sub_ps(d1, _mm256_mul_ps(r[1], _mm256_sub_ps(r[8], r[5])));
+				d1 = _mm256_add_ps(d1, _mm256_mul_ps(r[2], _mm256_sub_ps(r[7], r[4])));
+				d = _mm256_sub_ps(d, _mm256_andnot_ps(sign, _mm256_mul_ps(_mm256_set1_ps(a), d1)));
+			}
+			mask = _mm256_movemask_ps(_mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_LT_OQ));
+			for (l = 0; l < 8; l++)
+				if (mask & (1 << l))
+					faces->push_back(list ? list[i + l] : i + l);
+		}
+	}
+#endif
+#ifdef USE_SSE2
+	{
+		__m128 r[9], d, d1, sign;
+		sign = _mm_set1_ps(-0.0f);
+		for (; i + 4 <= n; i += 4)
+		{
+			for (l = 0; l < 4; l++)
+				gatherFace(map, vb, list ? list[i + l] : i + l, g, 4, l);
+			for (l = 0; l < 9; l++)
+				r[l] = _mm_loadu_ps(g + 4 * l);
+			d = _mm_mul_ps(r[0], _mm_sub_ps(_mm_mul_ps(r[4], r[8]), _mm_mul_ps(r[5], r[7])));
+			d = _mm_sub_ps(d, _mm_mul_ps(r[1], _mm_sub_ps(_mm_mul_ps(r[3], r[8]), _mm_mul_ps(r[5], r[6]))));
+			d = _mm_add_ps(d, _mm_mul_ps(r[2], _mm_sub_ps(_mm_mul_ps(r[3], r[7]), _mm_mul_ps(r[4], r[6]))));
+			if (a != 0.0f)
+			{
+				d1 = _mm_sub_ps(_mm_mul_ps(r[4], r[8]), _mm_mul_ps(r[5], r[7]));
+				d1 = _mm_sub_ps(d1, _mm_mul_ps(r[1], _mm_sub_ps(r[8], r[5])));
+				d1 = _mm_add_ps(d1, _mm_mul_ps(r[2], _mm_sub_ps(r[7], r[4])));
+				d = _mm_sub_ps(d, _mm_andnot_ps(sign, _mm_mul_ps(_mm_set1_ps(a), d1)));
+			}
+			mask = _mm_movemask_ps(_mm_cmplt_ps(d, _mm_setzero_ps()));
+			for (l = 0; l < 4; l++)
+				if (mask & (1 << l))
+					faces->push_back(list ? list[i + l] : i + l);
+		}
+	}
+#endif
+	for (; i < n; i++)
+	{
+		gatherFace(map, vb, list ? list[i] : i, g, 1, 0);
+		det = g[0] * (g[4] * g[8] - g[5] * g[7]);
+		det = det - g[1] * (g[3] * g[8] - g[5] * g[6]);
+		det = det + g[2] * (g[3] * g[7] - g[4] * g[6]);
+		if (a != 0.0f)
+			det = det - fabs(a * ((g[4] * g[8] - g[5] * g[7]) - g[1] * (g[8] - g[5]) + g[2] * (g[7] - g[4])));
+		if (det < 0.0f)
+			faces->push_back(list ? list[i] : i);
+	}
+}
+
+/*
+ * The planes bounding the view of vb in world space, as a * x + b * y +
+ * c * z + d, positive inside, for the camera projected by t: the near plane,
+ * the top and bottom sides of the image, and its left and right sides for
+ * the eye at +eyeShift and the one at -eyeShift. The sides have the one
+ * pixel margin of clipCode.
+ */
+void viewPlanes(VertexBuffer *vb, const Mat4 &t, float planes[7][4])
+{
+	float cx, cy, s, h;
+	int e, c;
+	cx = vb->centerX;
+	cy = vb->centerY;
+	s = vb->scale;
+	for (c = 0; c < 4; c++)
+	{
+		planes[0][c] = t.m[3][c];
+		planes[1][c] = s * t.m[1][c] + (cy + 1.0f) * t.m[3][c];
+		planes[2][c] = (vb->height + 1.0f - cy) * t.m[3][c] - s * t.m[1][c];
+	}
+	planes[0][3] -= NEAR_W;
+	/*
+	 * An eye shifted by h draws x + h * (1 / w - eyeInvW0): its sides are
+	 * those of the camera with w weighted differently, offset by h.
+	 */
+	for (e = 0; e < 2; e++)
+	{
+		h = (e == 0) ? vb->eyeShift : -vb->eyeShift;
+		for (c = 0; c < 4; c++)
+		{
+			planes[3 + e][c] = s * t.m[0][c] + (cx + 1.0f - h * vb->eyeInvW0) * t.m[3][c];
+			planes[5 + e][c] = (vb->width + 1.0f - cx + h * vb->eyeInvW0) * t.m[3][c] - s * t.m[0][c];
+		}
+		planes[3 + e][3] += h;
+		planes[5 + e][3] -= h;
+	}
+}
+
+/*
+ * Largest (most) or smallest value of plane p over the box lo .. hi.
+ */
+inline float boxPlane(const float *p, const float *lo, const float *hi, bool most)
+{
+	float v;
+	int k;
+	v = p[3];
+	for (k = 0; k < 3; k++)
+		v += p[k] * (((p[k] > 0.0f) == most) ? hi[k] : lo[k]);
+	return v;
+}
+
+/*
+ * Bits of the pixels of cell (i, j) of occ that lie outside the image.
+ */
+inline uint64_t occlusionOutside(Occlusion *occ, int i, int j)
+{
+	uint64_t outside;
+	int k, columns, rows;
+	columns = occ->width - 8 * i;
+	rows = occ->height - 8 * j;
+	if (columns >= 8 && rows >= 8)
+		return 0;
+	outside = 0;
+	for (k = 0; k < 8; k++)
+	{
+		if (k >= rows)
+			outside |= (uint64_t)0xFF << (8 * k);
+		else if (columns < 8)
+			outside |= (uint64_t)((0xFF << columns) & 0xFF) << (8 * k);
+	}
+	return outside;
+}
+
+/*
+ * Empties occ for a frame of width x height pixels.
+ */
+void clearOcclusion(Occlusion *occ, int width, int height)
+{
+	int i, j;
+	occ->width = width;
+	occ->height = height;
+	occ->cols = (width + 7) / 8;
+	occ->rows = (height + 7) / 8;
+	occ->mask.resize(occ->cols * occ->rows);
+	occ->zMax.assign(occ->cols * occ->rows, 0.0f);
+	for (j = 0; j < occ->rows; j++)
+		for (i = 0; i < occ->cols; i++)
+			occ->mask[j * occ->cols + i] = occlusionOutside(occ, i, j);
+	occ->budget = OCCLUDER_TRIANGLES;
+	occ->tested = occ->occluded = occ->skipped = 0;
+}
+
+/*
+ * Draws the front faces among list[0] .. list[n - 1], already projected in
+ * vb, into occ while its budget lasts. Only triangles that clipTriangles
+ * passes on unchanged are used, so each one is rasterized exactly as
+ * drawTriangleEdge will draw it.
+ */
+void drawOccluders(Occlusion *occ, Mesh3D *map, VertexBuffer *vb, const int *list, int n)
+{
+	size_t j;
+	int i, k, nc, v_1, v_2, v_3, code;
+	const int *corner;
+	cullFaces(map, vb, list, n, &occ->faces);
+	for (j = 0; j < occ->faces.size() && occ->budget > 0; j++)
+	{
+		i = occ->faces[j];
+		nc = map->f[i + 1] - map->f[i];
+		corner = map->idx + map->f[i];
+		v_1 = corner[0];
+		code = clipCode(vb, v_1);
+		for (k = 1; k + 1 < nc; k++)
+		{
+			v_2 = corner[k];
+			v_3 = corner[k + 1];
+			if ((code | clipCode(vb, v_2) | clipCode(vb, v_3)) & (CLIP_NEAR | CLIP_GUARD))
+				continue;
+			drawOccluder(occ, vb->x[v_1], vb->y[v_1], vb->z[v_1], vb->x[v_2], vb->y[v_2], vb->z[v_2], vb->x[v_3], vb->y[v_3], vb->z[v_3]);
+			occ->budget--;
+		}
+	}
+}
+
+/*
+ * Whether everything inside the box lo .. hi, seen through t, is hidden in
+ * occ: the pixels its projection can reach, with a pixel to spare for
+ * snapping, are all in full cells whose occluders are nearer than the
+ * nearest corner. Boxes reaching behind the near plane are never hidden.
+ * The corners bound the depth of every pixel drawn inside the box except
+ * on slivers, whose depth the rasterizer can extrapolate beyond them.
+ */
+bool boxOccluded(Occlusion *occ, const Mat4 &t, VertexBuffer *vb, const float *lo, const float *hi)
+{
+	Vec4 p, q;
+	float k, x, y, minX, maxX, minY, maxY, zMin;
+	int c, i, j;
+	minX = minY = zMin = numeric_limits<float>::max();
+	maxX = maxY = -numeric_limits<float>::max();
+	for (c = 0; c < 8; c++)
+	{
+		p.x = (c & 1) ? hi[0] : lo[0];
+		p.y = (c & 2) ? hi[1] : lo[1];
+		p.z = (c & 4) ? hi[2] : lo[2];
+		p.w = 1.0f;
+		q = multMat4Vec4(t, p);
+		if (!(q.w >= NEAR_W))
+			return false;
+		k = vb->scale / q.w;
+		x = vb->centerX + q.x * k;
+		y = vb->centerY + q.y * k;
+		minX = min(minX, x);
+		maxX = max(maxX, x);
+		minY = min(minY, y);
+		maxY = max(maxY, y);
+		zMin = min(zMin, q.z);
+	}
+	minX = max(0.0f, floorf(minX - 1.0f));
+	maxX = min(occ->width - 1.0f, ceilf(maxX + 1.0f));
+	minY = max(0.0f, floorf(minY - 1.0f));
+	maxY = min(occ->height - 1.0f, ceilf(maxY + 1.0f));
+	if (minX > maxX || minY > maxY)
+	{
+		return true;
+	}
+	for (j = (int)minY / 8; j <= (int)maxY / 8; j++)
+		for (i = (int)minX / 8; i <= (int)maxX / 8; i++)
+			if (occ->mask[j * occ->cols + i] != ~(uint64_t)0 || !(occ->zMax[j * occ->cols + i] < zMin))
+				return false;
+	return true;
+}
+
+/*
+ * Projects the parts of the mesh in view and stores its front faces in
+ * faces, in file order, for the camera of t drawing a width x height image
+ * (for a stereo pair, eyeShift and eyeInvW0 are as in VertexBuffer). The
+ * hierarchy of the mesh skips every subtree whose box is wholly behind the
+ * near plane, above or below the image, or beyond the same side of it for
+ * both eyes, so back face culling and everything after it only see faces
+ * near the view. Vertices are only projected for the faces kept, unless
+ * most of the mesh is kept anyway.
+ *
+ * With occlusion, the hierarchy is walked front to back down to its leaves,
+ * and the front faces of the leaves kept are drawn into the occlusion
+ * buffer as they are reached, so a subtree whose box is hidden behind them
+ * is skipped before any of its vertices is projected.
+ */
+void projectVisible(Mesh3D *map, const Mat4 &t, double scale, int width, int height, float eyeShift, float eyeInvW0, Occlusion *occlusion, VertexBuffer *vb, vector<int> *faces)
+{
+	Bvh *bvh;
+	BvhNode *node, *child;
+	float planes[7][4], w[2];
+	int i, k, n, vertices;
+	bool inside, outside, all;
+	vector<int> stack, kept, candidates;
+	vector<uint64_t> marked;
+	bvh = map->bvh;
+	setupVertexBuffer(map, scale, width, height, vb);
+	vb->eyeShift = eyeShift;
+	vb->eyeInvW0 = eyeInvW0;
+	viewPlanes(vb, t, planes);
+	if (occlusion != NULL)
+	{
+		clearOcclusion(occlusion, width, height);
+	}
+	vertices = 0;
+	if (bvh != NULL && !bvh->nodes.empty())
+		stack.push_back(0);
+	while (!stack.empty())
+	{
+		i = stack.back();
+		stack.pop_back();
+		node = &bvh->nodes[i];
+		outside = boxPlane(planes[0], node->lo, node->hi, true) < 0.0f || boxPlane(planes[1], node->lo, node->hi, true) < 0.0f || boxPlane(planes[2], node->lo, node->hi, true) < 0.0f;
+		outside = outside || (boxPlane(planes[3], node->lo, node->hi, true) < 0.0f && boxPlane(planes[4], node->lo, node->hi, true) < 0.0f);
+		outside = outside || (boxPlane(planes[5], node->lo, node->hi, true) < 0.0f && boxPlane(planes[6], node->lo, node->hi, true) < 0.0f);
+		if (outside)
+		{
+			continue;
+		}
+		if (occlusion != NULL)
+		{
+			occlusion->tested++;
+			if (boxOccluded(occlusion, t, vb, node->lo, node->hi))
+			{
+				occlusion->occluded++;
+				occlusion->skipped += node->count;
+				continue;
+			}
+			if (node->right == 0)
+			{
+				kept.push_back(i);
+				projectVertices(map, t, bvh->vertices.data() + node->firstVertex, node->vertexCount, vb);
+				if (occlusion->budget > 0)
+					drawOccluders(occlusion, map, vb, bvh->faces.data() + node->first, node->count);
+				continue;
+			}
+			/*
+			 * The nearer child, by the w of its centre, goes on top.
+			 */
+			for (k = 0; k < 2; k++)
+			{
+				child = &bvh->nodes[(k == 0) ? i + 1 : node->right];
+				w[k] = t.m[3][3];
+				for (n = 0; n < 3; n++)
+					w[k] += t.m[3][n] * 0.5f * (child->lo[n] + child->hi[n]);
+			}
+			stack.push_back((w[0] < w[1]) ? node->right : i + 1);
+			stack.push_back((w[0] < w[1]) ? i + 1 : node->right);
+			continue;
+		}
+		inside = true;
+		for (k = 0; k < 7 && inside; k++)
+			inside = boxPlane(planes[k], node->lo, node->hi, false) >= 0.0f;
+		if (inside || node->right == 0)
+		{
+			kept.push_back(i);
+			vertices += node->vertexCount;
+			continue;
+		}
+		stack.push_back(node->right);
+		stack.push_back(i + 1);
+	}
+	all = (bvh == NULL || bvh->nodes.empty() || (kept.size() == 1 && kept[0] == 0));
+	if (all || (occlusion == NULL && vertices * 2 >= map->np))
+	{
+		projectMesh(map, t, scale, width, height, vb);
+		vb->eyeShift = eyeShift;
+		vb->eyeInvW0 = eyeInvW0;
+	}
+	else if (occlusion == NULL)
+	{
+		for (i = 0; i < (int)kept.size(); i++)
+		{
+			node = &bvh->nodes[kept[i]];
+			projectVertices(map, t, bvh->vertices.data() + node->firstVertex, node->vertexCount, vb);
+		}
+	}
+	if (all)
+	{
+		cullFaces(map, vb, NULL, map->nf, faces);
+		return;
+	}
+	/*
+	 * Back to file order, the order faces are drawn in, through a bit per
+	 * face.
+	 */
+	marked.assign((map->nf + 63) / 64, 0);
+	for (i = 0; i < (int)kept.size(); i++)
+	{
+		node = &bvh->nodes[kept[i]];
+		for (k = node->first; k < node->first + node->count; k++)
+		{
+			n = bvh->faces[k];
+			marked[n >> 6] |= (uint64_t)1 << (n & 63);
+		}
+	}
+	for (i = 0; i < (int)marked.size(); i++)
+	{
+		for (k = 0; k < 64; k++)
+		{
+			if (marked[i] >> k == 0)
+				break;
+			if (marked[i] & ((uint64_t)1 << k))
+				candidates.push_back(64 * i + k);
+		}
+	}
+	cullFaces(map, vb, candidates.data(), (int)candidates.size(), faces);
+}
+
+/*
+ * Clip stage between setup and rasterization. Triangles wholly beyond one
+ * side of the view are dropped, and those reaching behind the near plane or
+ * out of the guard band are clipped in homogeneous space and split into a
+ * fan over the new vertices, in place of the original. Everything left
+ * projects inside the guard band with w >= NEAR_W (for a stereo pair,
+ * inside its top and bottom; see clipCode).
+ */
+void clipTriangles(VertexBuffer *vb, vector<Triangle> *tris)
+{
+	size_t i;
+	int k, n, all, any, code;
+	int src[CLIP_MAX];
+	Vec4 p[CLIP_MAX];
+	Triangle tri;
+	vector<Triangle> out;
+	out.reserve(tris->size());
+	for (i = 0; i < tris->size(); i++)
+	{
+		tri = (*tris)[i];
+		all = ~0;
+		any = 0;
+		for (k = 0; k < 3; k++)
+		{
+			code = clipCode(vb, tri.v[k]);
+			all &= code;
+			any |= code;
+		}
+		if (all & ~CLIP_GUARD)
+		{
+			continue;
+		}
+		if (!(any & (CLIP_NEAR | CLIP_GUARD)))
+		{
+			out.push_back(tri);
+			continue;
+		}
+		for (k = 0; k < 3; k++)
+		{
+			p[k] = clipVertex(vb, tri.v[k]);
+			src[k] = tri.v[k];
+		}
+		n = clipPolygon(vb, p, src, 3);
+		for (k = 0; k < n; k++)
+		{
+			if (src[k] < 0)
+				src[k] = addClipVertex(vb, p[k]);
+		}
+		for (k = 1; k + 1 < n; k++)
+		{
+			tri.v[0] = src[0];
+			tri.v[1] = src[k];
+			tri.v[2] = src[k + 1];
+			out.push_back(tri);
+		}
+	}
+	tris->swap(out);
+}
+
+void runThreadPoolJobs(ThreadPool *pool)
+{
+	int k;
+	while ((k = pool->next++) < pool->count)
+	{
+		pool->job(k);
+	}
+}
+
+void threadPoolWorker(ThreadPool *pool)
+{
+	unsigned seen = 0;
+	unique_lock<mutex> l(pool->lock);
+	while (true)
+	{
+		pool->wake.wait(l, [&] { return pool->quit || pool->generation != seen; });
+		if (pool->quit)
+			return;
+		seen = pool->generation;
+		l.unlock();
+		runThreadPoolJobs(pool);
+		l.lock();
+		if (++pool->done == (int)pool->workers.size())
+			pool->idle.notify_all();
+	}
+}
+
+/*
+ * Creates a pool that runs jobs on n threads in total: the calling thread
+ * plus n - 1 workers. n = 0 uses one thread per core.
+ */
+ThreadPool *createThreadPool(int n)
+{
+	ThreadPool *pool;
+	int i;
+	if (n <= 0)
+		n = max(1, (int)thread::hardware_concurrency());
+	pool = new ThreadPool;
+	pool->count = 0;
+	pool->next = 0;
+	pool->done = 0;
+	pool->generation = 0;
+	pool->quit = false;
+	for (i = 1; i < n; i++)
+	{
+		pool->workers.push_back(thread(threadPoolWorker, pool));
+	}
+	return pool;
+}
+
+/*
+ * Calls job(0) .. job(count - 1) across the pool and returns once all of them
+ * have finished. Jobs are handed out one at a time, in increasing order.
+ */
+void runThreadPool(ThreadPool *pool, int count, const function<void(int)> &job)
+{
+	unique_lock<mutex> l(pool->lock);
+	pool->job = job;
+	pool->count = count;
+	pool->next = 0;
+	pool->done = 0;
+	pool->generation++;
+	l.unlock();
+	pool->wake.notify_all();
+	runThreadPoolJobs(pool);
+	l.lock();
+	pool->idle.wait(l, [&] { return pool->done == (int)pool->workers.size(); });
+}
+
+void destroyThreadPool(ThreadPool *pool)
+{
+	size_t i;
+	{
+		lock_guard<mutex> l(pool->lock);
+		pool->quit = true;
+	}
+	pool->wake.notify_all();
+	for (i = 0; i < pool->workers.size(); i++)
+	{
+		pool->workers[i].join();
+	}
+	delete pool;
+}
+
+/*
+ * Flat colour of face i: its material scaled by the diffuse intensity of the
+ * light, or by 1 with ambient light.
+ */
+Color shadeFace(Mesh3D *map, int i, Point3D light, bool ilum, vector<Color> &material)
+{
+	Point3D n;
+	Color c;
+	double intensity;
+	if (ilum)
+	{
+		n = meshNormal(map, i);
+		intensity = pow((-dot3D(n, light)/magnitude(light)), material[map->mat[i] % material.size()].k);
+		if (intensity < 0.05)
+		{
+			intensity = 0.05;
+		}
+	}
+	else
+	{
+		intensity = 1.0;
+	}
+	c = material[map->mat[i] % material.size()];
+	c.r *= intensity * c.i;
+	c.g *= intensity * c.i;
+	c.b *= intensity * c.i;
+	return c;
+}
+
+/*
+ * Front end of the filled renderer: splits each face left by cullFaces into
+ * a fan of triangles, in file order. Faces are shaded here unless shade is
+ * false (deferred shading resolves colours per pixel later).
+ */
+void setupTriangles(Mesh3D *map, vector<int> &faces, Point3D light, bool ilum, vector<Color> &material, bool shade, vector<Triangle> *tris)
+{
+	size_t j;
+	int i, k, nc;
+	const int *corner;
+	Triangle tri;
+	tris->clear();
+	for (j = 0; j < faces.size(); j++)
+	{
+		i = faces[j];
+		nc = map->f[i + 1] - map->f[i];
+		tri.c = shade ? shadeFace(map, i, light, ilum, material) : COLOR_BLACK;
+		tri.face = i;
+		corner = map->idx + map->f[i];
+		tri.v[0] = corner[0];
+		for (k = 1; k + 1 < nc; k++)
+		{
+			tri.v[1] = corner[k];
+			tri.v[2] = corner[k + 1];
+			tris->push_back(tri);
+		}
+	}
+}
+
+/*
+ * Second pass of deferred shading: every pixel of the visibility buffer that
+ * a face won is shaded exactly once, so the cost follows the resolution
+ * rather than the overdraw. Rows are split among the pool threads.
+ */
+void resolveVisibility(Canvas *canvas, Mesh3D *map, Point3D light, bool ilum, vector<Color> &material, ThreadPool *pool)
+{
+	auto resolve = [&](int y) {
+		int x, id;
+		for (x = 0; x < canvas->w; x++)
+		{
+			if (!tileLive(canvas, x, y))
+			{
+				x |= TILE_SIZE - 1;
+				continue;
+			}
+			id = canvas->id[canvasIndex(canvas, x, y)];
+			if (id >= 0)
+			{
+				putColor(canvasColor(canvas, x, y), shadeFace(map, id, light, ilum, material));
+			}
+		}
+	};
+	int y;
+	if (pool != NULL)
+	{
+		runThreadPool(pool, canvas->h, resolve);
+		return;
+	}
+	for (y = 0; y < canvas->h; y++)
+	{
+		resolve(y);
+	}
+}
+
+/*
+ * Reorders tris roughly front to back so the depth test discards hidden
+ * pixels instead of overwriting them. The key is the nearest vertex depth
+ * quantized to 16 bits over the depth range of the batch, sorted with two
+ * stable 8 bit radix passes; triangles with equal keys keep file order.
+ */
+void sortTriangles(VertexBuffer *vb, vector<Triangle> *tris)
+{
+	size_t i, k, n, count[257];
+	int pass;
+	float lo, hi, d, scale;
+	vector<float> depth;
+	vector<uint16_t> key, keyTmp;
+	vector<Triangle> tmp;
+	n = tris->size();
+	depth.resize(n);
+	lo = numeric_limits<float>::max();
+	hi = -numeric_limits<float>::max();
+	for (i = 0; i < n; i++)
+	{
+		d = min(vb->z[(*tris)[i].v[0]], min(vb->z[(*tris)[i].v[1]], vb->z[(*tris)[i].v[2]]));
+		depth[i] = d;
+		if (fabs(d) <= numeric_limits<float>::max())
+		{
+			lo = min(lo, d);
+			hi = max(hi, d);
+		}
+	}
+	scale = (hi > lo) ? 65535.0f / (hi - lo) : 0.0f;
+	key.resize(n);
+	for (i = 0; i < n; i++)
+	{
+		if (fabs(depth[i]) <= numeric_limits<float>::max())
+			key[i] = (uint16_t)min(65535.0f, (depth[i] - lo) * scale);
+		else
+			key[i] = 65535;
+	}
+	keyTmp.resize(n);
+	tmp.resize(n);
+	for (pass = 0; pass < 16; pass += 8)
+	{
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[((key[i] >> pass) & 0xFF) + 1]++;
+		for (i = 1; i < 257; i++)
+			count[i] += count[i - 1];
+		for (i = 0; i < n; i++)
+		{
+			k = count[(key[i] >> pass) & 0xFF]++;
+			keyTmp[k] = key[i];
+			tmp[k] = (*tris)[i];
+		}
+		key.swap(keyTmp);
+		tris->swap(tmp);
+	}
+}
+
+/*
+ * Sort-middle renderer: every triangle is binned into the TILE_SIZE x
+ * TILE_SIZE tiles its bounding box touches, then the tiles are rasterized
+ * in parallel. A tile is only ever touched by the thread rasterizing it and
+ * sees its triangles in submission order, so the result is bit-identical to
+ * rasterizing the whole canvas with drawTriangleEdge on one thread. Tile
+ * rows are handed out from the top of the image down, the order in which
+ * pipe (if any) writes them.
+ */
+void drawTrianglesTiled(Canvas *canvas, VertexBuffer *vb, vector<Triangle> &tris, ThreadPool *pool, OutputPipe *pipe)
+{
+	int tilesX, tilesY, i, k, tx, ty;
+	float minX, maxX, minY, maxY, oy;
+	vector<int> start, fill, bin, range;
+	oy = (float)canvas->originY;
+	tilesX = (canvas->w + TILE_SIZE - 1) / TILE_SIZE;
+	tilesY = (canvas->h + TILE_SIZE - 1) / TILE_SIZE;
+	start.assign(tilesX * tilesY + 1, 0);
+	range.resize(4 * tris.size());
+	for (i = 0; i < (int)tris.size(); i++)
+	{
+		minX = min(vb->x[tris[i].v[0]], min(vb->x[tris[i].v[1]], vb->x[tris[i].v[2]]));
+		maxX = max(vb->x[tris[i].v[0]], max(vb->x[tris[i].v[1]], vb->x[tris[i].v[2]]));
+		minY = min(vb->y[tris[i].v[0]], min(vb->y[tris[i].v[1]], vb->y[tris[i].v[2]])) - oy;
+		maxY = max(vb->y[tris[i].v[0]], max(vb->y[tris[i].v[1]], vb->y[tris[i].v[2]])) - oy;
+		if (!(maxX >= 0.0f && maxY >= 0.0f && minX < canvas->w && minY < canvas->h))
+		{
+			range[4 * i] = range[4 * i + 2] = 1;
+			range[4 * i + 1] = range[4 * i + 3] = 0;
+			continue;
+		}
+		range[4 * i] = (int)max(minX - 1.0f, 0.0f) / TILE_SIZE;
+		range[4 * i + 1] = (int)min(maxX + 1.0f, (float)(canvas->w - 1)) / TILE_SIZE;
+		range[4 * i + 2] = (int)max(minY - 1.0f, 0.0f) / TILE_SIZE;
+		range[4 * i + 3] = (int)min(maxY + 1.0f, (float)(canvas->h - 1)) / TILE_SIZE;
+		for (ty = range[4 * i + 2]; ty <= range[4 * i + 3]; ty++)
+			for (tx = range[4 * i]; tx <= range[4 * i + 1]; tx++)
+				start[ty * tilesX + tx + 1]++;
+	}
+	for (k = 0; k < tilesX * tilesY; k++)
+	{
+		start[k + 1] += start[k];
+	}
+	fill.assign(start.begin(), start.end() - 1);
+	bin.resize(start.back());
+	for (i = 0; i < (int)tris.size(); i++)
+	{
+		for (ty = range[4 * i + 2]; ty <= range[4 * i + 3]; ty++)
+			for (tx = range[4 * i]; tx <= range[4 * i + 1]; tx++)
+				bin[fill[ty * tilesX + tx]++] = i;
+	}
+	runThreadPool(pool, tilesX * tilesY, [&](int k) {
+		int j;
+		Triangle *tri;
+		int tile = (tilesY - 1 - k / tilesX) * tilesX + k % tilesX;
+		int x_0 = (tile % tilesX) * TILE_SIZE;
+		int y_0 = canvas->originY + (tile / tilesX) * TILE_SIZE;
+		int x_1 = min(canvas->w, x_0 + TILE_SIZE);
+		int y_1 = min(canvas->originY + canvas->h, y_0 + TILE_SIZE);
+		for (j = start[tile]; j < start[tile + 1]; j++)
+		{
+			tri = &tris[bin[j]];
+			drawTriangleEdge(canvas, x_0, y_0, x_1, y_1, vb->x[tri->v[0]], vb->y[tri->v[0]], vb->z[tri->v[0]], vb->x[tri->v[1]], vb->y[tri->v[1]], vb->z[tri->v[1]], vb->x[tri->v[2]], vb->y[tri->v[2]], vb->z[tri->v[2]], tri->c, tri->face);
+		}
+		if (pipe != NULL)
+		{
+			pipeTileDone(pipe, tile / tilesX);
+		}
+	});
+}
+
+/*
+ * Projects the mesh for a w x h image and sets up the triangles of its
+ * front faces in view, clipped, in the order they are to be drawn. eyeShift
+ * and eyeInvW0 are as in projectVisible.
+ */
+void setupFrame(Mesh3D *map, Point3D light, bool ilum, const Mat4 &t, double scale, int w, int h, float eyeShift, float eyeInvW0, vector<Color> &material, RenderOptions *opt, VertexBuffer *vb, vector<int> *faces, vector<Triangle> *tris)
+{
+	projectVisible(map, t, scale, w, h, eyeShift, eyeInvW0, opt->occlusion, vb, faces);
+	setupTriangles(map, *faces, light, ilum, material, !opt->deferred, tris);
+	clipTriangles(vb, tris);
+	if (opt->sort)
+	{
+		sortTriangles(vb, tris);
+	}
+}
+
+/*
+ * Projection seen from an eye moved along the camera's right axis, derived
+ * from vb, which was projected for the camera itself. With direction and up
+ * vector orthonormal the move only adds a constant to the clip space x of
+ * every vertex, so y, z and w are shared and x changes by shift / w. invW0 is
+ * the 1 / w of the convergence point; subtracting it keeps points at that
+ * depth in place, on the screen plane, with nearer ones in front of it.
+ */
+void projectEye(VertexBuffer *vb, float shift, float invW0, VertexBuffer *eye)
+{
+	size_t j, n;
+	n = vb->x.size();
+	*eye = *vb;
+	eye->eyeShift = 0.0f;
+	for (j = 0; j < n; j++)
+	{
+		eye->x[j] = vb->x[j] + shift * (1.0f / vb->w[j] - invW0);
+		eye->clipX[j] = vb->clipX[j] + shift / vb->scale * (1.0f - invW0 * vb->w[j]);
+	}
+}
+
+/*
+ * Triangles of tris that may cover image rows [y_0, y_1), in the same order.
+ */
+void bandTriangles(VertexBuffer *vb, vector<Triangle> &tris, int y_0, int y_1, vector<Triangle> *band)
+{
+	size_t i;
+	float minY, maxY;
+	band->clear();
+	for (i = 0; i < tris.size(); i++)
+	{
+		minY = min(vb->y[tris[i].v[0]], min(vb->y[tris[i].v[1]], vb->y[tris[i].v[2]]));
+		maxY = max(vb->y[tris[i].v[0]], max(vb->y[tris[i].v[1]], vb->y[tris[i].v[2]]));
+		if (maxY < y_0 - 1.0f || minY > y_1 + 1.0f)
+		{
+			continue;
+		}
+		band->push_back(tris[i]);
+	}
+}
+
+/*
+ * Rasterizes tris, set up by setupFrame, into the rows of the image the
+ * canvas holds.
+ */
+void drawTriangles(Canvas *canvas, Mesh3D *map, VertexBuffer *vb, vector<Triangle> &tris, Point3D light, bool ilum, vector<Color> &material, RenderOptions *opt)
+{
+	size_t i;
+	int v_1, v_2, v_3;
+	if (opt->deferred)
+	{
+		createVisibilityBuffer(canvas);
+	}
+	if (opt->pool != NULL)
+	{
+		drawTrianglesTiled(canvas, vb, tris, opt->pool, opt->deferred ? NULL : opt->pipe);
+	}
+	else
+	{
+		for (i = 0; i < tris.size(); i++)
+		{
+			v_1 = tris[i].v[0];
+			v_2 = tris[i].v[1];
+			v_3 = tris[i].v[2];
+			if (opt->raster == RASTER_EDGE || opt->deferred)
+			{
+				drawTriangleEdge(canvas, 0, canvas->originY, canvas->w, canvas->originY + canvas->h, vb->x[v_1], vb->y[v_1], vb->z[v_1], vb->x[v_2], vb->y[v_2], vb->z[v_2], vb->x[v_3], vb->y[v_3], vb->z[v_3], tris[i].c, tris[i].face);
+			}
+			else
+			{
+				drawTriangle(canvas, vb->x[v_1], vb->y[v_1], vb->z[v_1], vb->x[v_2], vb->y[v_2], vb->z[v_2], vb->x[v_3], vb->y[v_3], vb->z[v_3], tris[i].c);
+			}
+		}
+	}
+	if (opt->deferred)
+	{
+		resolveVisibility(canvas, map, light, ilum, material, opt->pool);
+	}
+}
+
+vector<Color> colorsFromMaterial(char *fileName) {
+	vector<Color> colors;
+	ifstream file;
+	file.open(fileName);
+	Color color;
+
+	while(file >> color.r >> color.g >> color.b >> color.i >> color.k) {
+		colors.push_back(color);
+	}
+
+	file.close();
+	
+	return colors;
+}
+
+void cameraFromFile(Point3D *pos, Point3D *dir, Point3D *up, char *fileName) {
+	ifstream file;
+	file.open(fileName);
+	file >> pos->x >> pos->y >> pos->z;
+	file >> dir->x >> dir->y >> dir->z;
+	file >> up->x >> up->y >> up->z;
+	file.close();
+}
+
+Point3D lightFromFile(char *fileName) {
+	Point3D light;
+	ifstream file;
+	file.open(fileName);
+	file >> light.x >> light.y >> light.z;
+	file.close();
+	return light;
+}
+
+/*
+ * Reads the camera path of a .scene file. The file starts with a camera
+ * (position, direction and up vector, nine numbers), as cameraFromFile reads
+ * it; every further nine numbers are another keyframe. A line
+ *     bezier  p1 c1 c2 p2
+ *     hermite p1 p2 t1 t2
+ * makes the camera position follow that curve instead (four points, as in
+ * the Curves program), and
+ *     target x y z
+ * keeps the camera aimed at a point. Returns false if no camera was read.
+ */
+bool cameraPathFromFile(CameraPath *path, char *fileName)
+{
+	ifstream file;
+	string word;
+	const char *c;
+	double v[9];
+	Point3D p;
+	int n, k;
+	path->type = PATH_KEYFRAMES;
+	path->aim = false;
+	path->pos.clear();
+	path->dir.clear();
+	path->up.clear();
+	path->control.clear();
+	n = 0;
+	file.open(fileName);
+	while (file >> word)
+	{
+		if (word == "bezier" || word == "hermite")
+		{
+			path->type = (word == "bezier") ? PATH_BEZIER : PATH_HERMITE;
+			path->control.clear();
+			for (k = 0; k < 4 && file >> p.x >> p.y >> p.z; k++)
+				path->control.push_back(p);
+			if (k < 4)
+				path->type = PATH_KEYFRAMES;
+		}
+		else if (word == "target")
+		{
+			path->aim = (bool)(file >> path->target.x >> path->target.y >> path->target.z);
+		}
+		else
+		{
+			c = word.c_str();
+			if (!parseDouble(&c, c + word.size(), &v[n]))
+				break;
+			if (++n == 9)
+			{
+				p.x = v[0]; p.y = v[1]; p.z = v[2];
+				path->pos.push_back(p);
+				p.x = v[3]; p.y = v[4]; p.z = v[5];
+				path->dir.push_back(p);
+				p.x = v[6]; p.y = v[7]; p.z = v[8];
+				path->up.push_back(p);
+				n = 0;
+			}
+		}
+	}
+	file.close();
+	return !path->pos.empty();
+}
+
+/*
+ * Whether the path describes more than a single camera.
+ */
+bool cameraPathMoves(CameraPath *path)
+{
+	return path->pos.size() > 1 || path->type != PATH_KEYFRAMES || path->aim;
+}
+
+Point3D normalized(Point3D a)
+{
+	double l;
+	l = magnitude(a);
+	if (l > 0.0)
+	{
+		a.x /= l;
+		a.y /= l;
+		a.z /= l;
+	}
+	return a;
+}
+
+Point3D lerp3D(Point3D a, Point3D b, double f)
+{
+	Point3D c;
+	c.x = a.x + (b.x - a.x) * f;
+	c.y = a.y + (b.y - a.y) * f;
+	c.z = a.z + (b.z - a.z) * f;
+	return c;
+}
+
+/*
+ * Point of a cubic curve at parameter t: [t^3 t^2 t 1] m g, with m the basis
+ * matrix and g the four geometry points, as drawCurve evaluates it.
+ */
+Point3D curvePoint(const double m[4][4], const vector<Point3D> &g, double t)
+{
+	double tv[4], b;
+	Point3D p;
+	int i, j;
+	tv[0] = t * t * t;
+	tv[1] = t * t;
+	tv[2] = t;
+	tv[3] = 1.0;
+	p.x = p.y = p.z = 0.0;
+	for (i = 0; i < 4; i++)
+	{
+		b = 0.0;
+		for (j = 0; j < 4; j++)
+			b += tv[j] * m[j][i];
+		p.x += b * g[i].x;
+		p.y += b * g[i].y;
+		p.z += b * g[i].z;
+	}
+	return p;
+}
+
+/*
+ * Camera at parameter t in [0, 1] along the path. Keyframes are spaced evenly
+ * and interpolated linearly, directions renormalized; the up vector is made
+ * perpendicular to the direction again whenever it is not a keyframe's own.
+ */
+void cameraAt(CameraPath *path, double t, Point3D *pos, Point3D *dir, Point3D *up)
+{
+	static const double BEZIER[4][4] = {{-1, 3, -3, 1}, {3, -6, 3, 0}, {-3, 3, 0, 0}, {1, 0, 0, 0}};
+	static const double HERMITE[4][4] = {{2, -2, 1, 1}, {-3, 3, -2, -1}, {0, 0, 1, 0}, {1, 0, 0, 0}};
+	double s, f;
+	int i, n;
+	bool key;
+	n = (int)path->pos.size();
+	s = t * (n - 1);
+	i = min((int)s, n - 1);
+	f = s - i;
+	key = (f == 0.0);
+	if (key)
+	{
+		*pos = path->pos[i];
+		*dir = path->dir[i];
+		*up = path->up[i];
+	}
+	else
+	{
+		*pos = lerp3D(path->pos[i], path->pos[i + 1], f);
+		*dir = normalized(lerp3D(path->dir[i], path->dir[i + 1], f));
+		*up = normalized(lerp3D(path->up[i], path->up[i + 1], f));
+	}
+	if (path->type != PATH_KEYFRAMES)
+	{
+		*pos = curvePoint(path->type == PATH_BEZIER ? BEZIER : HERMITE, path->control, t);
+	}
+	if (path->aim)
+	{
+		*dir = normalized(pointDiff(path->target, *pos));
+		key = false;
+	}
+	if (!key)
+	{
+		s = dot3D(*up, *dir);
+		up->x -= s * dir->x;
+		up->y -= s * dir->y;
+		up->z -= s * dir->z;
+		*up = normalized(*up);
+	}
+}
+
+/*
+ * Draws the edge between vertices v_1 and v_2 of vb, clipped against the
+ * near plane and the guard band like triangles are.
+ */
+void drawClippedLine(Canvas *canvas, VertexBuffer *vb, int v_1, int v_2, Color c)
+{
+	int code_1, code_2, k;
+	float d_1, d_2;
+	Vec4 p_1, p_2;
+	code_1 = clipCode(vb, v_1);
+	code_2 = clipCode(vb, v_2);
+	if (code_1 & code_2 & ~CLIP_GUARD)
+	{
+		return;
+	}
+	if (!((code_1 | code_2) & (CLIP_NEAR | CLIP_GUARD)))
+	{
+		drawLine(canvas, vb->x[v_1], vb->y[v_1], vb->x[v_2], vb->y[v_2], c);
+		return;
+	}
+	p_1 = clipVertex(vb, v_1);
+	p_2 = clipVertex(vb, v_2);
+	for (k = 0; k < 5; k++)
+	{
+		d_1 = clipDistance(vb, p_1, k);
+		d_2 = clipDistance(vb, p_2, k);
+		if (d_1 < 0.0f && d_2 < 0.0f)
+			return;
+		if (d_1 < 0.0f)
+			p_1 = lerpVec4(p_1, p_2, d_1 / (d_1 - d_2));
+		else if (d_2 < 0.0f)
+			p_2 = lerpVec4(p_2, p_1, d_2 / (d_2 - d_1));
+	}
+	drawLine(canvas, vb->centerX + p_1.x * (vb->scale / p_1.w), vb->centerY + p_1.y * (vb->scale / p_1.w), vb->centerX + p_2.x * (vb->scale / p_2.w), vb->centerY + p_2.y * (vb->scale / p_2.w), c);
+}
+
+/*
+ * Draws the edges of the faces left by cullFaces, projected into vb, in
+ * white.
+ */
+void drawMapLines(Canvas *canvas, Mesh3D *map, VertexBuffer *vb, vector<int> &faces)
+{
+	size_t j;
+	int i, k, nc;
+	int v_1, v_2;
+	const int *corner;
+	for (j = 0; j < faces.size(); j++)
+	{
+		i = faces[j];
+		nc = map->f[i + 1] - map->f[i];
+		corner = map->idx + map->f[i];
+		v_1 = corner[0];
+		v_2 = corner[1];
+		drawClippedLine(canvas, vb, v_1, v_2, COLOR_WHITE);
+		v_2 = corner[nc - 1];
+		drawClippedLine(canvas, vb, v_1, v_2, COLOR_WHITE);
+		for (k = 1; k + 1 < nc; k++)
+		{
+			v_1 = corner[k];
+			v_2 = corner[k + 1];
+			drawClippedLine(canvas, vb, v_1, v_2, COLOR_WHITE);
+		}
+	}
+}
+
+/*
+ * Name of frame k of a sequence written to filename: the frame number goes
+ * before the extension, as in out_0007.png.
+ */
+void frameFileName(const char *filename, int k, char *name)
+{
+	const char *dot;
+	dot = strrchr(filename, '.');
+	if (dot == NULL || strpbrk(dot, "/\\") != NULL)
+		dot = filename + strlen(filename);
+	sprintf(name, "%.*s_%04d%s", (int)(dot - filename), filename, k, dot);
+}
+
+/*
+ * Prints the counters gathered while rendering to stderr.
+ */
+void printStats(RenderStats *s)
+{
+	if (s->triangles > 0)
+	{
+		fprintf(stderr, "hi-z: %lld of %lld triangles rejected (%.1f%%)\n", (long long)s->trianglesCulled, (long long)s->triangles, s->triangles ? 100.0 * s->trianglesCulled / s->triangles : 0.0);
+		fprintf(stderr, "hi-z: %lld of %lld 8x8 blocks rejected (%.1f%%)\n", (long long)s->blocksCulled, (long long)s->blocks, s->blocks ? 100.0 * s->blocksCulled / s->blocks : 0.0);
+	}
+	fprintf(stderr, "depth: %lld fragments, %lld written, %lld pixels covered, overdraw %.2f\n", (long long)s->fragments, (long long)s->fragmentsWritten, s->covered, s->covered ? (double)s->fragmentsWritten / s->covered : 0.0);
+}
+
+/*
+ * Number of pixels of the canvas that something was drawn to.
+ */
+long long countCovered(Canvas *canvas)
+{
+	long long covered;
+	int i, j;
+	covered = 0;
+	for (j = 0; j < canvas->h; j++)
+		for (i = 0; i < canvas->w; i++)
+			if (tileLive(canvas, i, j) && canvas->z[canvasIndex(canvas, i, j)] != numeric_limits<float>::max())
+				covered++;
+	return covered;
+}
+
+int main(int argc, char **argv) {
+	Mesh3D *map;
+	Point3D center = {0.0, 0.0, 0.0};
+	Point3D dir = {0.0, 0.0, 1.0};
+	Point3D up = {0.0, 1.0, 0.0};
+	Point3D light = {0.0, 0.0, 1.0};
+	Canvas *canvas;
+	CanvasPool canvases;
+	RenderStats *rs;
+	VertexBuffer vb;
+	vector<int> faces;
+	vector<Triangle> tris, band;
+	vector<Color> cl;
+	int w, h;
+	int i, bandRows, y_0, y_1, frame, frames;
+	double angle;
+	Point3D eye, view, sun, pivot, eyeUp;
+	CameraPath path;
+	bool moves;
+	StereoMode stereo;
+	VertexBuffer eyeVb[2], *frameVb;
+	vector<Triangle> eyeTris[2];
+	Canvas *eyeCanvas[2];
+	vector<Triangle> *list;
+	Point3D right;
+	double eyeDistance, a, w0;
+	float shift, invW0;
+	int e, eyes, outW;
+	ImageFormat format;
+	bool video, streamOut = false;
+	double scale, eps;
+	bool zEn = true, ilum = true;
+	bool wireframe = false, convert = false, stats = false, pngStored = false, pipeline = false, occlusion = false;
+	ImageWriter *iw;
+	RenderOptions opt;
+	Layout layout = LAYOUT_LINEAR;
+	int threads = -1;
+	char filename[1024];
+	char rfilename[1024];
+	char mfilename[1024];
+	char ofilename[1024] = "out.ppm";
+	char name[1100];
+	size_t len;
+	w = 1920;
+	h = 1080;
+	scale = 500.0;
+	eps = 0.0;
+	bandRows = 0;
+	frames = 0;
+	format = IMAGE_PPM;
+	stereo = STEREO_NONE;
+	eyeDistance = 0.2;
+	rs = NULL;
+	opt.raster = RASTER_SCANLINE;
+	opt.pool = NULL;
+	opt.sort = false;
+	opt.deferred = false;
+	opt.pipe = NULL;
+	opt.occlusion = NULL;
+	strcpy(filename, "in");
+	for (i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "-w") == 0) || (strcmp(argv[i], "--width") == 0))
+		{
+			i++;
+			sscanf(argv[i], "%d", &w);
+		}
+		else if ((strcmp(argv[i], "-h") == 0) || (strcmp(argv[i], "--height") == 0))
+		{
+			i++;
+			sscanf(argv[i], "%d", &h);
+		}
+		else if (strcmp(argv[i], "c") == 0)
+		{
+			i++;
+			sscanf(argv[i], "%lf", &center.x);
+			i++;
+			sscanf(argv[i], "%lf", &center.y);
+			i++;
+			sscanf(argv[i], "%lf", &center.z);
+		}
+		else if (strcmp(argv[i], "d") == 0)
+		{
+			i++;
+			sscanf(argv[i], "%lf", &dir.x);
+			i++;
+			sscanf(argv[i], "%lf", &dir.y);
+			i++;
+			sscanf(argv[i], "%lf", &dir.z);
+		}
+		else if (strcmp(argv[i], "u") == 0)
+		{
+			i++;
+			sscanf(argv[i], "%lf", &up.x);
+			i++;
+			sscanf(argv[i], "%lf", &up.y);
+			i++;
+			sscanf(argv[i], "%lf", &up.z);
+		}
+		else if ((strcmp(argv[i], "-s") == 0) || (strcmp(argv[i], "--scale") == 0))
+		{
+			i++;
+			sscanf(argv[i], "%lf", &scale);
+		}
+		else if ((strcmp(argv[i], "-W") == 0) || (strcmp(argv[i], "--wireframe") == 0))
+		{
+			wireframe = true;
+		}
+		else if (strcmp(argv[i], "--depthdisable") == 0)
+		{
+			zEn = false;
+		}
+		else if (strcmp(argv[i], "--ambient") == 0)
+		{
+			ilum = false;
+		}
+		else if (strcmp(argv[i], "--convert") == 0)
+		{
+			convert = true;
+		}
+		else if (strcmp(argv[i], "--weld") == 0)
+		{
+			i++;
+			sscanf(argv[i], "%lf", &eps);
+		}
+		else if ((strcmp(argv[i], "-r") == 0) || (strcmp(argv[i], "--rasterizer") == 0))
+		{
+			i++;
+			opt.raster = (strcmp(argv[i], "edge") == 0) ? RASTER_EDGE : RASTER_SCANLINE;
+		}
+		else if ((strcmp(argv[i], "-t") == 0) || (strcmp(argv[i], "--threads") == 0))
+		{
+			i++;
+			sscanf(argv[i], "%d", &threads);
+		}
+		else if (strcmp(argv[i], "--deferred") == 0)
+		{
+			opt.deferred = true;
+		}
+		else if (strcmp(argv[i], "--sort") == 0)
+		{
+			opt.sort = true;
+		}
+		else if (strcmp(argv[i], "--layout") == 0)
+		{
+			i++;
+			layout = (strcmp(argv[i], "tiled") == 0) ? LAYOUT_TILED : LAYOUT_LINEAR;
+		}
+		else if (strcmp(argv[i], "-o") == 0)
+		{
+			i++;
+			sscanf(argv[i], "%1023s", ofilename);
+		}
+		else if (strcmp(argv[i], "--png") == 0)
+		{
+			i++;
+			pngStored = (strcmp(argv[i], "stored") == 0);
+		}
+		else if (strcmp(argv[i], "--pipeline") == 0)
+		{
+			pipeline = true;
+		}
+		else if (strcmp(argv[i], "--frames") == 0)
+		{
+			i++;
+			sscanf(argv[i], "%d", &frames);
+		}
+		else if (strcmp(argv[i], "--stream") == 0)
+		{
+			i++;
+			streamOut = true;
+			format = (strcmp(argv[i], "rgb") == 0) ? IMAGE_RGB : IMAGE_Y4M;
+		}
+		else if (strcmp(argv[i], "--stereo") == 0)
+		{
+			i++;
+			stereo = (strcmp(argv[i], "anaglyph") == 0) ? STEREO_ANAGLYPH : STEREO_SIDE_BY_SIDE;
+		}
+		else if (strcmp(argv[i], "--eyes") == 0)
+		{
+			i++;
+			sscanf(argv[i], "%lf", &eyeDistance);
+		}
+		else if (strcmp(argv[i], "--band") == 0)
+		{
+			i++;
+			sscanf(argv[i], "%d", &bandRows);
+		}
+		else if (strcmp(argv[i], "--stats") == 0)
+		{
+			stats = true;
+		}
+		else if (strcmp(argv[i], "--occlusion") == 0)
+		{
+			occlusion = true;
+		}
+		else
+		{
+			sscanf(argv[i], "%s", filename);
+		}
+	}
+	len = strlen(filename);
+	if (len > 4 && (strcmp(filename + len - 4, ".raw") == 0 || strcmp(filename + len - 4, ".lff") == 0))
+	{
+		strcpy(mfilename, filename);
+		filename[len - 4] = '\0';
+		map = openMap(mfilename, eps);
+	}
+	else
+	{
+		strcpy(mfilename, filename);
+		strcat(mfilename, convert ? ".raw" : ".lff");
+		map = openMap(mfilename, eps);
+		if (map == NULL && !convert)
+		{
+			strcpy(mfilename, filename);
+			strcat(mfilename, ".raw");
+			map = openMap(mfilename, eps);
+		}
+	}
+	if (map == NULL)
+	{
+		fprintf(stderr, "Cannot open %s\n", mfilename);
+		return EXIT_FAILURE;
+	}
+	if (convert)
+	{
+		strcpy(rfilename, filename);
+		strcat(rfilename, ".lff");
+		if (!saveLffMap(map, rfilename))
+		{
+			fprintf(stderr, "Cannot write %s\n", rfilename);
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+	if (stats)
+	{
+		rs = new RenderStats;
+		rs->triangles = rs->trianglesCulled = 0;
+		rs->blocks = rs->blocksCulled = 0;
+		rs->fragments = rs->fragmentsWritten = 0;
+		rs->covered = 0;
+	}
+	map->bvh = buildBvh(map);
+	strcpy(rfilename, filename);
+	strcat(rfilename, ".scene");
+	cameraFromFile(&center, &dir, &up, rfilename);
+	moves = cameraPathFromFile(&path, rfilename) && cameraPathMoves(&path);
+	if (threads >= 0)
+	{
+		opt.raster = RASTER_EDGE;
+		opt.pool = createThreadPool(threads);
+	}
+	/*
+	 * The occlusion buffer follows the coverage of the edge rasterizer and
+	 * relies on the depth test; a stereo pair would need one per eye.
+	 */
+	if (occlusion && !wireframe && zEn && stereo == STEREO_NONE)
+	{
+		opt.raster = RASTER_EDGE;
+		opt.occlusion = new Occlusion;
+	}
+	if (frames < 1 && moves)
+		frames = (path.type == PATH_KEYFRAMES) ? (int)path.pos.size() : 100;
+	if (frames < 1)
+		frames = 1;
+	if (streamOut)
+		strcpy(ofilename, "-");
+	else
+		format = imageFormat(ofilename);
+	video = (format == IMAGE_Y4M || format == IMAGE_RGB);
+	if (!wireframe)
+	{
+		strcpy(rfilename, filename);
+		strcat(rfilename, ".material");
+		cl = colorsFromMaterial(rfilename);
+		strcpy(rfilename, filename);
+		strcat(rfilename, ".light");
+		light = lightFromFile(rfilename);
+	}
+	if (bandRows <= 0 || bandRows >= h)
+		bandRows = h;
+	else
+		bandRows = (bandRows + STRIP_ROWS - 1) / STRIP_ROWS * STRIP_ROWS;
+	pivot = meshCenter(map);
+	outW = (stereo == STEREO_SIDE_BY_SIDE) ? 2 * w : w;
+	iw = NULL;
+	for (frame = 0; frame < frames; frame++)
+	{
+		if (iw == NULL)
+		{
+			if (frames > 1 && !video)
+				frameFileName(ofilename, frame, name);
+			else
+				strcpy(name, ofilename);
+			iw = openImageWriter(name, format, pngStored, outW, h);
+			if (iw == NULL)
+			{
+				fprintf(stderr, "Cannot write %s\n", name);
+				return EXIT_FAILURE;
+			}
+		}
+		/*
+		 * The mesh, materials and canvases are shared by all the frames;
+		 * each one only projects, culls and rasterizes again.
+		 */
+		eye = center;
+		view = dir;
+		eyeUp = up;
+		sun = light;
+		if (moves)
+		{
+			cameraAt(&path, frames > 1 ? (double)frame / (frames - 1) : 0.0, &eye, &view, &eyeUp);
+		}
+		else if (frame > 0)
+		{
+			angle = 2.0 * PI * frame / frames;
+			eye = rotateAbout(pointDiff(center, pivot), up, angle);
+			eye.x += pivot.x;
+			eye.y += pivot.y;
+			eye.z += pivot.z;
+			view = rotateAbout(dir, up, angle);
+			sun = rotateAbout(light, up, angle);
+		}
+		Mat4 t;
+		t = createProjectionMatrix(eye, view, eyeUp, -2, 2);
+		eyes = 1;
+		shift = invW0 = 0.0f;
+		if (stereo != STEREO_NONE)
+		{
+			right = cross3D(eyeUp, view);
+			a = t.m[0][0] * right.x + t.m[0][1] * right.y + t.m[0][2] * right.z;
+			w0 = t.m[3][0] * pivot.x + t.m[3][1] * pivot.y + t.m[3][2] * pivot.z + t.m[3][3];
+			invW0 = (w0 > 0.0) ? (float)(1.0 / w0) : 0.0f;
+			shift = (float)(0.5 * eyeDistance * a * scale);
+			eyes = 2;
+		}
+		/*
+		 * With stereo, culling, shading and clipping at the near plane are
+		 * done once for the camera between the eyes, keeping what either
+		 * eye sees; the eye projections follow from vb, and each eye clips
+		 * its copy of the triangles against its own sides of the guard band.
+		 */
+		if (wireframe)
+		{
+			projectVisible(map, t, scale, w, h, shift, invW0, NULL, &vb, &faces);
+		}
+		else
+		{
+			setupFrame(map, sun, ilum, t, scale, w, h, shift, invW0, cl, &opt, &vb, &faces, &tris);
+			if (stats && opt.occlusion != NULL)
+				fprintf(stderr, "occlusion: frame %d, %d of %d boxes hidden, %d faces skipped\n", frame, opt.occlusion->occluded, opt.occlusion->tested, opt.occlusion->skipped);
+		}
+		if (eyes == 2)
+		{
+			for (e = 0; e < 2; e++)
+			{
+				projectEye(&vb, (e == 0) ? shift : -shift, invW0, &eyeVb[e]);
+				if (!wireframe)
+				{
+					eyeTris[e] = tris;
+					clipTriangles(&eyeVb[e], &eyeTris[e]);
+				}
+			}
+		}
+		/*
+		 * Bands go from the top of the image down, in the order the file is
+		 * written; only the bottom one can be shorter. Each band draws just
+		 * the triangles that reach its rows.
+		 */
+		for (y_1 = h; y_1 > 0; y_1 -= bandRows)
+		{
+			y_0 = max(0, y_1 - bandRows);
+			for (e = 0; e < eyes; e++)
+			{
+				frameVb = (eyes == 1) ? &vb : &eyeVb[e];
+				list = (eyes == 1) ? &tris : &eyeTris[e];
+				if (!wireframe && bandRows != h)
+				{
+					bandTriangles(frameVb, *list, y_0, y_1, &band);
+					list = &band;
+				}
+				canvas = acquireCanvas(&canvases, w, y_1 - y_0, layout);
+				if (canvas == NULL)
+					return EXIT_FAILURE;
+				canvas->originY = y_0;
+				canvas->zEnabled = zEn;
+				canvas->stats = rs;
+				if (pipeline && bandRows == h && eyes == 1)
+					opt.pipe = startOutputPipe(canvas, iw);
+				if (wireframe)
+					drawMapLines(canvas, map, frameVb, faces);
+				else
+					drawTriangles(canvas, map, frameVb, *list, sun, ilum, cl, &opt);
+				if (rs != NULL)
+					rs->covered += countCovered(canvas);
+				eyeCanvas[e] = canvas;
+			}
+			if (eyes == 2)
+			{
+				canvas = acquireCanvas(&canvases, outW, y_1 - y_0, LAYOUT_LINEAR);
+				if (canvas == NULL)
+					return EXIT_FAILURE;
+				canvas->originY = y_0;
+				composeStereo(eyeCanvas[0], eyeCanvas[1], stereo, canvas);
+				releaseCanvas(&canvases, eyeCanvas[0]);
+				releaseCanvas(&canvases, eyeCanvas[1]);
+			}
+			if (opt.pipe != NULL)
+			{
+				finishOutputPipe(opt.pipe);
+				opt.pipe = NULL;
+			}
+			else
+			{
+				writeCanvasStrips(iw, canvas, opt.pool);
+			}
+			releaseCanvas(&canvases, canvas);
+		}
+		if (!video || frame == frames - 1)
+		{
+			if (!closeImageWriter(iw))
+			{
+				fprintf(stderr, "Cannot write %s\n", name);
+				return EXIT_FAILURE;
+			}
+			iw = NULL;
+		}
+	}
+	destroyCanvasPool(&canvases);
+	if (opt.pool != NULL)
+	{
+		destroyThreadPool(opt.pool);
+	}
+	delete opt.occlusion;
+	if (stats)
+	{
+		printStats(rs);
+	}
+	return EXIT_SUCCESS;
+}
+
+void swap(int *a, int *b) {
+	int c;
+	c = *a;
+	*a = *b;
+	*b = c;
+}
+
+void swapDouble(double *a, double *b) {
+	double c;
+	c = *a;
+	*a = *b;
+	*b = c;
+}
+
+/*
+ * Stores c into the packed pixel at p. Only the low byte of each channel is
+ * kept, as the PPM writer always did.
+ */
+inline void putColor(uchar *p, Color c)
+{
+	p[0] = (uchar)c.r;
+	p[1] = (uchar)c.g;
+	p[2] = (uchar)c.b;
+}
+
+/*
+ * Depth tested write of image pixel (x, y), which must be inside the canvas;
+ * drawScanline scissors its spans to it.
+ */
+void drawPixelZ(Canvas *canvas, int x, int y, double z, Color c) {
+	size_t k;
+	y -= canvas->originY;
+	if (canvas->stats != NULL)
+		canvas->stats->fragments++;
+	if (!tileLive(canvas, x, y))
+		clearTile(canvas, x / TILE_SIZE, y / TILE_SIZE);
+	k = canvasIndex(canvas, x, y);
+	if (canvas->zEnabled && ((float)z > canvas->z[k] || z < 0))
+		return;
+	canvas->z[k] = (float)z;
+	putColor(canvasColor(canvas, x, y), c);
+	hizMark(canvas, x, y);
+	if (canvas->stats != NULL)
+		canvas->stats->fragmentsWritten++;
+}
+
+/*
+ * Flags the hierarchical Z block and tile holding pixel (x, y) after a write
+ * to the depth buffer.
+ */
+void hizMark(Canvas *canvas, int x, int y)
+{
+	canvas->zBlockDirty[(y >> 3) * canvas->blocksX + (x >> 3)] = 1;
+	canvas->zTileDirty[(y / TILE_SIZE) * canvas->tilesX + x / TILE_SIZE] = 1;
+}
+
+/*
+ * Farthest depth stored in 8x8 block (bx, by).
+ */
+float hizBlockMax(Canvas *canvas, int bx, int by)
+{
+	int k, i, j;
+	float m;
+	if (!tileLive(canvas, bx * 8, by * 8))
+		return numeric_limits<float>::max();
+	k = by * canvas->blocksX + bx;
+	if (canvas->zBlockDirty[k])
+	{
+		m = -numeric_limits<float>::max();
+		for (j = by * 8; j < min(canvas->h, by * 8 + 8); j++)
+			for (i = bx * 8; i < min(canvas->w, bx * 8 + 8); i++)
+				m = max(m, canvas->z[canvasIndex(canvas, i, j)]);
+		canvas->zBlock[k] = m;
+		canvas->zBlockDirty[k] = 0;
+	}
+	return canvas->zBlock[k];
+}
+
+/*
+ * Farthest depth stored in tile (tx, ty).
+ */
+float hizTileMax(Canvas *canvas, int tx, int ty)
+{
+	int k, i, j;
+	float m;
+	k = ty * canvas->tilesX + tx;
+	if (canvas->tileGeneration[k] != canvas->generation)
+		return numeric_limits<float>::max();
+	if (canvas->zTileDirty[k])
+	{
+		m = -numeric_limits<float>::max();
+		for (j = ty * (TILE_SIZE / 8); j < min(canvas->blocksY, (ty + 1) * (TILE_SIZE / 8)); j++)
+			for (i = tx * (TILE_SIZE / 8); i < min(canvas->blocksX, (tx + 1) * (TILE_SIZE / 8)); i++)
+				m = max(m, hizBlockMax(canvas, i, j));
+		canvas->zTile[k] = m;
+		canvas->zTileDirty[k] = 0;
+	}
+	return canvas->zTile[k];
+}
+
+void drawPixel(Canvas *canvas, int x, int y, Color c) {
+	y -= canvas->originY;
+	if (x < 0 || y < 0 || x >= canvas->w || y >= canvas->h)
+		return;
+	if (!tileLive(canvas, x, y))
+		clearTile(canvas, x / TILE_SIZE, y / TILE_SIZE);
+	putColor(canvasColor(canvas, x, y), c);
+}
+
+void drawLine(Canvas *canvas, int x_1, int y_1, int x_2, int y_2, Color c) {
+	int sx, sy;
+	int err, e2;
+	int dx, dy;
+	dx = abs(x_2 - x_1);
+	dy = abs(y_2 - y_1);
+	sx = (x_1 < x_2) ? 1 : -1;
+	sy = (y_1 < y_2) ? 1 : -1;
+	err = dx - dy;
+	drawPixel(canvas, x_1, y_1, c);
+	while (x_1 != x_2 || y_1 != y_2) {
+		e2 = 2 * err;
+		if (e2 > -dy) { 
+			err -= dy;
+			x_1 += sx;
+		}
+		if (e2 < dx) { 
+			err += dx;
+			y_1 += sy; 
+		}
+		drawPixel(canvas, x_1, y_1, c);
+	}
+}
+
+void drawScanline(Canvas *canvas, int x_1, int x_2, int y, double z_1, double z_2, Color c)
+{
+	double dz, mz;
+	if (y < canvas->originY || y >= canvas->originY + canvas->h)
+		return;
+	if (x_1 > x_2)
+	{
+		swap(&x_1, &x_2);
+		swapDouble(&z_1, &z_2);
+	}
+	dz = (z_2 - z_1) / (x_2 - x_1);
+	mz = z_1;
+	if (x_1 < 0)
+	{
+		mz += dz * -x_1;
+		x_1 = 0;
+	}
+	x_2 = min(x_2, canvas->w - 1);
+	while (x_1 <= x_2)
+	{
+		drawPixelZ(canvas, x_1, y, mz, c);
+		x_1++;
+		mz += dz;
+	}
+}
+
+void drawTriangle(Canvas *canvas, int x_1, int y_1, double z_1, int x_2, int y_2, double z_2, int x_3, int y_3, double z_3, Color c)
+{
+	int dx_1, dy_1, dx_2, dy_2, sx_1, sx_2;
+	double dz_1, dz_2;
+	int mx_1, mx_2, y;
+	double mz_1, mz_2;
+	int err_1, err_2;
+	if (y_2 < y_1)
+	{
+		swap(&x_1, &x_2);
+		swap(&y_1, &y_2);
+		swapDouble(&z_1, &z_2);
+	}
+	if (y_3 < y_1)
+	{
+		swap(&x_1, &x_3);
+		swap(&y_1, &y_3);
+		swapDouble(&z_1, &z_3);
+	}
+	if (y_3 < y_2)
+	{
+		swap(&x_2, &x_3);
+		swap(&y_2, &y_3);
+		swapDouble(&z_2, &z_3);
+	}
+	dx_2 = abs(x_3 - x_1);
+	sx_2 = (x_3 > x_1) ? 1 : -1;
+	dy_2 = y_3 - y_1;
+	if (y_1 == y_2)
+	{
+		if (y_2 == y_3)
+		{
+			drawScanline(canvas, x_1, x_2, y_1, z_1, z_2, c);
+			drawScanline(canvas, x_2, x_3, y_1, z_2, z_3, c);
+			return;
+		}
+		drawScanline(canvas, x_1, x_2, y_1, z_1, z_2, c);
+		err_2 = dx_2;
+		mx_2 = x_1 + sx_2 * (err_2 / dy_2);
+		err_2 = err_2 % dy_2;
+		dz_2 = (z_3 - z_1) / dy_2; 
+		mz_2 = z_1 + dz_2;
+	}
+	else
+	{
+		dx_1 = abs(x_2 - x_1);
+		sx_1 = (x_2 > x_1) ? 1 : -1;
+		dy_1 = y_2 - y_1;
+		y = y_1;
+		mx_1 = mx_2 = x_1;
+		err_1 = err_2 = 0;
+		dz_1 = (z_2 - z_1) / dy_1;
+		dz_2 = (z_3 - z_1) / dy_2;
+		mz_1 = mz_2 = z_1;
+		while (y <= y_2)
+		{
+			drawScanline(canvas, mx_1, mx_2, y, mz_1, mz_2, c);
+			y++;
+			err_1 += dx_1;
+			err_2 += dx_2;
+			mx_1 += sx_1 * (err_1 / dy_1);
+			mx_2 += sx_2 * (err_2 / dy_2);
+			err_1 = err_1 % dy_1;
+			err_2 = err_2 % dy_2;
+			mz_1 += dz_1;
+			mz_2 += dz_2;
+		}
+	}
+	if (y_2 != y_3)
+	{
+		dx_1 = abs(x_3 - x_2);
+		dy_1 = y_3 - y_2;
+		sx_1 = (x_3 > x_2) ? 1 : -1;
+		y = y_2 + 1;
+		mx_1 = x_2 + sx_1 * (dx_1 / dy_1);
+		err_1 = dx_1 % dy_1;
+		dz_1 = (z_3 - z_2) / dy_1;
+		mz_1 = z_2 + dz_1;
+		while(y <= y_3)
+		{
+			drawScanline(canvas, mx_1, mx_2, y, mz_1, mz_2, c);
+			y++;
+			err_1 += dx_1;
+			err_2 += dx_2;
+			mx_1 += sx_1 * (err_1 / dy_1);
+			mx_2 += sx_2 * (err_2 / dy_2);
+			err_1 = err_1 % dy_1;
+			err_2 = err_2 % dy_2;
+			mz_1 += dz_1;
+			mz_2 += dz_2;
+		}
+	}
+}
+
+/*
+ * Allocates a w x h canvas, or returns NULL if there is no memory for its
+ * colour and depth buffers.
+ */
+Canvas *createCanvas(int w, int h, Layout layout) {
+	int i, j;
+	size_t pixels, bytes;
+	Canvas *c;
+	c = new Canvas;
+	c->w = w;
+	c->h = h;
+	c->originY = 0;
+	c->layout = layout;
+	c->blocksX = (w + 7) / 8;
+	c->blocksY = (h + 7) / 8;
+	if (layout == LAYOUT_TILED)
+	{
+		c->stride = 0;
+		pixels = (size_t)c->blocksX * c->blocksY * 64;
+		bytes = 3 * pixels;
+		for (j = 0; j < 8; j++)
+			for (i = 0; i < 8; i++)
+				c->blockOffset[8 * j + i] = (i & 1) | ((j & 1) << 1) | ((i & 2) << 1) | ((j & 2) << 2) | ((i & 4) << 2) | ((j & 4) << 3);
+	}
+	else
+	{
+		c->stride = (3 * w + 63) & ~63;
+		pixels = (size_t)w * h;
+		bytes = (size_t)c->stride * h;
+		for (j = 0; j < 8; j++)
+			for (i = 0; i < 8; i++)
+				c->blockOffset[8 * j + i] = j * w + i;
+	}
+	for (i = 0; i < 64; i++)
+		c->colorOffset[i] = (layout == LAYOUT_TILED) ? 3 * c->blockOffset[i] : (i / 8) * c->stride + 3 * (i % 8);
+	c->rgb = (uchar *)alignedAlloc(bytes);
+	c->z = (float *)alignedAlloc(pixels * sizeof(float));
+	if (c->rgb == NULL || c->z == NULL)
+	{
+		alignedFree(c->rgb);
+		alignedFree(c->z);
+		delete c;
+		return NULL;
+	}
+	c->zEnabled = true;
+	c->tilesX = (w + TILE_SIZE - 1) / TILE_SIZE;
+	c->tilesY = (h + TILE_SIZE - 1) / TILE_SIZE;
+	c->zBlock = new float[c->blocksX * c->blocksY];
+	c->zBlockDirty = new uchar[c->blocksX * c->blocksY];
+	c->zTile = new float[c->tilesX * c->tilesY];
+	c->zTileDirty = new uchar[c->tilesX * c->tilesY];
+	c->tileGeneration = new unsigned[c->tilesX * c->tilesY];
+	for (i = 0; i < c->tilesX * c->tilesY; i++) {
+		c->tileGeneration[i] = 0;
+	}
+	c->generation = 1;
+	c->stats = NULL;
+	c->id = NULL;
+	return c;
+}
+
+void freeCanvas(Canvas *c) {
+	alignedFree(c->rgb);
+	alignedFree(c->z);
+	if (c->id != NULL)
+		alignedFree(c->id);
+	delete[] c->zBlock;
+	delete[] c->zBlockDirty;
+	delete[] c->zTile;
+	delete[] c->zTileDirty;
+	delete[] c->tileGeneration;
+	delete c;
+}
+
+/*
+ * Starts a new frame: every tile becomes stale, which reads as cleared, in
+ * constant time whatever the resolution.
+ */
+void clearCanvas(Canvas *c) {
+	int i;
+	if (++c->generation == 0) {
+		for (i = 0; i < c->tilesX * c->tilesY; i++)
+			c->tileGeneration[i] = 0;
+		c->generation = 1;
+	}
+}
+
+/*
+ * Really clears tile (tx, ty) (black, infinitely far, no face) and marks it
+ * as live for the current frame. Only the thread drawing a tile touches it.
+ */
+void clearTile(Canvas *canvas, int tx, int ty) {
+	int x_0, y_0, x_1, y_1, x, y, i;
+	size_t base;
+	x_0 = tx * TILE_SIZE;
+	y_0 = ty * TILE_SIZE;
+	x_1 = min(canvas->w, x_0 + TILE_SIZE);
+	y_1 = min(canvas->h, y_0 + TILE_SIZE);
+	if (canvas->layout == LAYOUT_LINEAR) {
+		for (y = y_0; y < y_1; y++) {
+			base = (size_t)y * canvas->w + x_0;
+			memset(canvasColor(canvas, x_0, y), 0, 3 * (x_1 - x_0));
+			fill(canvas->z + base, canvas->z + base + (x_1 - x_0), numeric_limits<float>::max());
+			if (canvas->id != NULL)
+				fill(canvas->id + base, canvas->id + base + (x_1 - x_0), -1);
+		}
+	}
+	else {
+		for (y = y_0; y < y_1; y += 8)
+			for (x = x_0; x < x_1; x += 8) {
+				base = canvasBlockIndex(canvas, x, y);
+				memset(canvas->rgb + 3 * base, 0, 3 * 64);
+				fill(canvas->z + base, canvas->z + base + 64, numeric_limits<float>::max());
+				if (canvas->id != NULL)
+					fill(canvas->id + base, canvas->id + base + 64, -1);
+			}
+	}
+	for (y = y_0 / 8; y < (y_1 + 7) / 8; y++)
+		for (x = x_0 / 8; x < (x_1 + 7) / 8; x++) {
+			i = y * canvas->blocksX + x;
+			canvas->zBlock[i] = numeric_limits<float>::max();
+			canvas->zBlockDirty[i] = 0;
+		}
+	i = ty * canvas->tilesX + tx;
+	canvas->zTile[i] = numeric_limits<float>::max();
+	canvas->zTileDirty[i] = 0;
+	canvas->tileGeneration[i] = canvas->generation;
+}
+
+/*
+ * Returns a cleared w x h canvas, reusing one released to the pool with the
+ * same size and layout when there is one. Returns NULL, after saying so on
+ * stderr, if a new one cannot be allocated.
+ */
+Canvas *acquireCanvas(CanvasPool *pool, int w, int h, Layout layout) {
+	size_t i;
+	Canvas *c;
+	for (i = 0; i < pool->canvases.size(); i++) {
+		c = pool->canvases[i];
+		if (c->w == w && c->h == h && c->layout == layout) {
+			pool->canvases.erase(pool->canvases.begin() + i);
+			clearCanvas(c);
+			return c;
+		}
+	}
+	c = createCanvas(w, h, layout);
+	if (c == NULL)
+		fprintf(stderr, "Cannot allocate a %d x %d canvas\n", w, h);
+	return c;
+}
+
+void releaseCanvas(CanvasPool *pool, Canvas *c) {
+	pool->canvases.push_back(c);
+}
+
+void destroyCanvasPool(CanvasPool *pool) {
+	size_t i;
+	for (i = 0; i < pool->canvases.size(); i++)
+		freeCanvas(pool->canvases[i]);
+	pool->canvases.clear();
+}
+
+/*
+ * Adds a visibility buffer to the canvas: from then on the edge rasterizer
+ * stores the id of the winning face per pixel (-1 where nothing was drawn)
+ * instead of its colour.
+ */
+void createVisibilityBuffer(Canvas *canvas)
+{
+	size_t i, pixels;
+	if (canvas->id != NULL)
+		return;
+	if (canvas->layout == LAYOUT_TILED)
+		pixels = (size_t)canvas->blocksX * canvas->blocksY * 64;
+	else
+		pixels = (size_t)canvas->w * canvas->h;
+	canvas->id = (int *)alignedAlloc(pixels * sizeof(int));
+	for (i = 0; i < pixels; i++)
+		canvas->id[i] = -1;
+}
+
+/*
+ * Copies image row y, which the canvas must hold, into row as packed RGB8,
+ * undoing the block layout of a tiled canvas and blanking stale tiles on the
+ * way.
+ */
+void canvasRow(Canvas *canvas, int y, uchar *row)
+{
+	int x, i, n;
+	const uchar *block;
+	y -= canvas->originY;
+	for (x = 0; x < canvas->w; x += TILE_SIZE)
+	{
+		n = min(TILE_SIZE, canvas->w - x);
+		if (!tileLive(canvas, x, y))
+			memset(row + 3 * x, 0, 3 * n);
+		else if (canvas->layout == LAYOUT_LINEAR)
+			memcpy(row + 3 * x, canvasColor(canvas, x, y), 3 * n);
+		else
+			for (i = 0; i < n; i++)
+			{
+				block = canvas->rgb + 3 * canvasBlockIndex(canvas, (x + i) & ~7, y & ~7);
+				memcpy(row + 3 * (x + i), block + canvas->colorOffset[8 * (y & 7) + ((x + i) & 7)], 3);
+			}
+	}
+}
+
+/*
+ * Fills out, a linear canvas holding the same image rows as the two eye
+ * canvases, with the stereo pair: left and right side by side, or a red-cyan
+ * anaglyph with red from the left eye and green and blue from the right one.
+ * Every pixel is written, so the tiles of out are simply marked live.
+ */
+void composeStereo(Canvas *left, Canvas *right, StereoMode mode, Canvas *out)
+{
+	int x, y, i;
+	uchar *row;
+	vector<uchar> l(3 * left->w), r(3 * right->w);
+	for (i = 0; i < out->tilesX * out->tilesY; i++)
+	{
+		out->tileGeneration[i] = out->generation;
+	}
+	for (y = 0; y < out->h; y++)
+	{
+		canvasRow(left, out->originY + y, &l[0]);
+		canvasRow(right, out->originY + y, &r[0]);
+		row = canvasColor(out, 0, y);
+		if (mode == STEREO_SIDE_BY_SIDE)
+		{
+			memcpy(row, &l[0], l.size());
+			memcpy(row + l.size(), &r[0], r.size());
+			continue;
+		}
+		for (x = 0; x < out->w; x++)
+		{
+			row[3 * x] = l[3 * x];
+			row[3 * x + 1] = r[3 * x + 1];
+			row[3 * x + 2] = r[3 * x + 2];
+		}
+	}
+}
+
+/*
+ * Runs job(0) .. job(count - 1) on the pool, or in order on the calling
+ * thread when there is none.
+ */
+void parallelFor(ThreadPool *pool, int count, const function<void(int)> &job)
+{
+	int k;
+	if (pool != NULL)
+	{
+		runThreadPool(pool, count, job);
+		return;
+	}
+	for (k = 0; k < count; k++)
+	{
+		job(k);
+	}
+}
+
+/*
+ * Output rows [strip * STRIP_ROWS, (strip + 1) * STRIP_ROWS) of an image h
+ * rows high, clamped to its height. Output row 0 is the top, image row h - 1.
+ */
+void stripRows(int h, int strip, int *r_0, int *r_1)
+{
+	*r_0 = strip * STRIP_ROWS;
+	*r_1 = min(h, *r_0 + STRIP_ROWS);
 }
 
-void drawFilledMap3D(Canvas *canvas, Map3D *map, Point3D dir, Point3D light, bool ilum, Matrix *t, double scale, vector<Color> material)
+/*
+ * QOI encoder for one strip. Every strip starts with a full QOI_OP_RGB pixel
+ * and an empty colour index, and never continues a run across its end, so
+ * strips encoded independently concatenate into a valid stream.
+ */
+void qoiStrip(Canvas *canvas, int imageH, int strip, vector<uchar> *out)
 {
-	int k;
-	Map3D::iterator i;
-	Face3D::iterator j;
-	Face3D f;
-	Point3D p_1, p_2, p_3, v_1, v_2;
-	Point3D n;
-	Matrix *pm, *r_1, *r_2, *r_3;
-	double dotP;
-	Color c;
-	double intensity;
-	for (i = map->begin(), k = 0; i != map->end(); i++, k = (k + 1) % material.size())
-	{
-		f = *i;
-		j = f.begin();
-		p_1 = *j;
-		j++;
-		p_2 = *j;
-		j++;
-		p_3 = *j;
-		v_1 = pointDiff(p_1, p_2);
-		v_2 = pointDiff(p_1, p_3);
-		n = cross3D(v_1, v_2);
-		dotP = -dot3D(n, dir);
-		if (dotP > 0.0)
-		{
-			pm = point3DToMatrix(p_1);
-			r_1 = multMatrix(t, pm);
-			pm = point3DToMatrix(p_2);
-			r_2 = multMatrix(t, pm);
-			pm = point3DToMatrix(p_3);
-			r_3 = multMatrix(t, pm);
-			if (ilum)
-			{
-				intensity = pow((-dot3D(n, light)/(magnitude(n)*magnitude(light))), material[k].k);
-				if (intensity < 0.05)
+	uchar index[64][4], px[4], prev[4];
+	int r_0, r_1, r, x, run, h;
+	signed char vr, vg, vb, vg_r, vg_b;
+	bool first;
+	vector<uchar> row(3 * canvas->w);
+	stripRows(imageH, strip, &r_0, &r_1);
+	memset(index, 0, sizeof(index));
+	prev[0] = prev[1] = prev[2] = 0;
+	prev[3] = 255;
+	px[3] = 255;
+	run = 0;
+	first = true;
+	out->clear();
+	for (r = r_0; r < r_1; r++)
+	{
+		canvasRow(canvas, imageH - 1 - r, &row[0]);
+		for (x = 0; x < canvas->w; x++)
+		{
+			px[0] = row[3 * x];
+			px[1] = row[3 * x + 1];
+			px[2] = row[3 * x + 2];
+			if (!first && memcmp(px, prev, 4) == 0)
+			{
+				run++;
+				if (run == 62)
 				{
-					intensity = 0.05;
+					out->push_back(0xC0 | (run - 1));
+					run = 0;
 				}
+				continue;
+			}
+			if (run > 0)
+			{
+				out->push_back(0xC0 | (run - 1));
+				run = 0;
+			}
+			h = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+			if (!first && memcmp(index[h], px, 4) == 0)
+			{
+				out->push_back(h);
 			}
 			else
 			{
-				intensity = 1.0;
+				memcpy(index[h], px, 4);
+				vr = px[0] - prev[0];
+				vg = px[1] - prev[1];
+				vb = px[2] - prev[2];
+				vg_r = vr - vg;
+				vg_b = vb - vg;
+				if (first)
+				{
+					out->push_back(0xFE);
+					out->push_back(px[0]);
+					out->push_back(px[1]);
+					out->push_back(px[2]);
+				}
+				else if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+				{
+					out->push_back(0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+				}
+				else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8)
+				{
+					out->push_back(0x80 | (vg + 32));
+					out->push_back((vg_r + 8) << 4 | (vg_b + 8));
+				}
+				else
+				{
+					out->push_back(0xFE);
+					out->push_back(px[0]);
+					out->push_back(px[1]);
+					out->push_back(px[2]);
+				}
 			}
-			c = material[k];
-			c.r *= intensity * c.i;
-			c.g *= intensity * c.i;
-			c.b *= intensity * c.i;
-			drawScaledTriangle(canvas, r_1->val[0][0], r_1->val[1][0], r_1->val[2][0], r_2->val[0][0], r_2->val[1][0], r_2->val[2][0], r_3->val[0][0], r_3->val[1][0], r_3->val[2][0], scale / r_1->val[3][0], scale / r_2->val[3][0], scale / r_3->val[3][0], c);
+			memcpy(prev, px, 4);
+			first = false;
 		}
 	}
+	if (run > 0)
+	{
+		out->push_back(0xC0 | (run - 1));
+	}
 }
 
-vector<Color> colorsFromMaterial(char *fileName) {
-	vector<Color> colors;
-	ifstream file;
-	file.open(fileName);
-	Color color;
+/*
+ * Converts one strip to BT.601 limited range Y'CbCr 4:2:0 for Y4M. Luma goes
+ * to y, one byte per pixel; u and v get (w + 1) / 2 samples per pair of rows,
+ * each from the average of a 2x2 block, repeating the last column or row of
+ * an odd sized image. Strips start on even rows, so a block never straddles
+ * two of them.
+ */
+void yuvStrip(Canvas *canvas, int imageH, int strip, uchar *y, uchar *u, uchar *v)
+{
+	int r_0, r_1, r, k, i, n, cw;
+	int rs, gs, bs;
+	short *R[2], *G[2], *B[2];
+	uchar *out, *cb, *cr;
+	vector<uchar> row(3 * canvas->w);
+	vector<short> p;
+	stripRows(imageH, strip, &r_0, &r_1);
+	cw = (canvas->w + 1) / 2;
+	n = 2 * cw;
+	p.resize(6 * n);
+	for (k = 0; k < 2; k++)
+	{
+		R[k] = &p[(3 * k) * n];
+		G[k] = &p[(3 * k + 1) * n];
+		B[k] = &p[(3 * k + 2) * n];
+	}
+	for (r = r_0; r < r_1; r += 2)
+	{
+		for (k = 0; k < 2; k++)
+		{
+			canvasRow(canvas, imageH - 1 - min(r + k, r_1 - 1), &row[0]);
+			for (i = 0; i < canvas->w; i++)
+			{
+				R[k][i] = row[3 * i];
+				G[k][i] = row[3 * i + 1];
+				B[k][i] = row[3 * i + 2];
+			}
+			if (n > canvas->w)
+			{
+				R[k][n - 1] = R[k][n - 2];
+				G[k][n - 1] = G[k][n - 2];
+				B[k][n - 1] = B[k][n - 2];
+			}
+			if (r + k >= r_1)
+				continue;
+			out = y + (size_t)(r + k - r_0) * canvas->w;
+			i = 0;
+#ifdef USE_SSE2
+			{
+				__m128i kr = _mm_set1_epi16(66), kg = _mm_set1_epi16(129), kb = _mm_set1_epi16(25);
+				__m128i half = _mm_set1_epi16(128), base = _mm_set1_epi16(16), vr, vg, vb, vy;
+				for (; i + 8 <= canvas->w; i += 8)
+				{
+					vr = _mm_loadu_si128((const __m128i *)(R[k] + i));
+					vg = _mm_loadu_si128((const __m128i *)(G[k] + i));
+					vb = _mm_loadu_si128((const __m128i *)(B[k] + i));
+					vy = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(vr, kr), _mm_mullo_epi16(vg, kg)), _mm_add_epi16(_mm_mullo_epi16(vb, kb), half));
+					vy = _mm_add_epi16(_mm_srli_epi16(vy, 8), base);
+					_mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(vy, vy));
+				}
+			}
+#endif
+			for (; i < canvas->w; i++)
+			{
+				out[i] = (uchar)(((66 * R[k][i] + 129 * G[k][i] + 25 * B[k][i] + 128) >> 8) + 16);
+			}
+		}
+		cb = u + (size_t)(r - r_0) / 2 * cw;
+		cr = v + (size_t)(r - r_0) / 2 * cw;
+		i = 0;
+#ifdef USE_SSE2
+		{
+			__m128i ones = _mm_set1_epi16(1), two = _mm_set1_epi16(2);
+			__m128i half = _mm_set1_epi16(128), vr, vg, vb, vu, vv;
+			for (; i + 8 <= cw; i += 8)
+			{
+				/*
+				 * Adds the two rows, then adjacent pixels with madd, and
+				 * packs the eight 2x2 sums back into 16 bit lanes.
+				 */
+				vr = _mm_packs_epi32(_mm_madd_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i *)(R[0] + 2 * i)), _mm_loadu_si128((const __m128i *)(R[1] + 2 * i))), ones),
+					_mm_madd_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i *)(R[0] + 2 * i + 8)), _mm_loadu_si128((const __m128i *)(R[1] + 2 * i + 8))), ones));
+				vg = _mm_packs_epi32(_mm_madd_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i *)(G[0] + 2 * i)), _mm_loadu_si128((const __m128i *)(G[1] + 2 * i))), ones),
+					_mm_madd_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i *)(G[0] + 2 * i + 8)), _mm_loadu_si128((const __m128i *)(G[1] + 2 * i + 8))), ones));
+				vb = _mm_packs_epi32(_mm_madd_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i *)(B[0] + 2 * i)), _mm_loadu_si128((const __m128i *)(B[1] + 2 * i))), ones),
+					_mm_madd_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i *)(B[0] + 2 * i + 8)), _mm_loadu_si128((const __m128i *)(B[1] + 2 * i + 8))), ones));
+				vr = _mm_srli_epi16(_mm_add_epi16(vr, two), 2);
+				vg = _mm_srli_epi16(_mm_add_epi16(vg, two), 2);
+				vb = _mm_srli_epi16(_mm_add_epi16(vb, two), 2);
+				vu = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(vr, _mm_set1_epi16(-38)), _mm_mullo_epi16(vg, _mm_set1_epi16(-74))), _mm_add_epi16(_mm_mullo_epi16(vb, _mm_set1_epi16(112)), half));
+				vv = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(vr, _mm_set1_epi16(112)), _mm_mullo_epi16(vg, _mm_set1_epi16(-94))), _mm_add_epi16(_mm_mullo_epi16(vb, _mm_set1_epi16(-18)), half));
+				vu = _mm_add_epi16(_mm_srai_epi16(vu, 8), half);
+				vv = _mm_add_epi16(_mm_srai_epi16(vv, 8), half);
+				_mm_storel_epi64((__m128i *)(cb + i), _mm_packus_epi16(vu, vu));
+				_mm_storel_epi64((__m128i *)(cr + i), _mm_packus_epi16(vv, vv));
+			}
+		}
+#endif
+		for (; i < cw; i++)
+		{
+			rs = (R[0][2 * i] + R[0][2 * i + 1] + R[1][2 * i] + R[1][2 * i + 1] + 2) >> 2;
+			gs = (G[0][2 * i] + G[0][2 * i + 1] + G[1][2 * i] + G[1][2 * i + 1] + 2) >> 2;
+			bs = (B[0][2 * i] + B[0][2 * i + 1] + B[1][2 * i] + B[1][2 * i + 1] + 2) >> 2;
+			cb[i] = (uchar)(((-38 * rs - 74 * gs + 112 * bs + 128) >> 8) + 128);
+			cr[i] = (uchar)(((112 * rs - 94 * gs - 18 * bs + 128) >> 8) + 128);
+		}
+	}
+}
 
-	while(file >> color.r >> color.g >> color.b >> color.i >> color.k) {
-		colors.push_back(color);
+void putBE32(vector<uchar> *v, uint32_t x)
+{
+	v->push_back(x >> 24);
+	v->push_back(x >> 16);
+	v->push_back(x >> 8);
+	v->push_back(x);
+}
+
+/*
+ * Bit writer for deflate streams: bits are packed starting from the least
+ * significant one.
+ */
+typedef struct
+{
+	vector<uchar> *out;
+	uint64_t bits;
+	int count;
+} BitWriter;
+
+void putBits(BitWriter *bw, uint32_t value, int n)
+{
+	bw->bits |= (uint64_t)value << bw->count;
+	bw->count += n;
+	while (bw->count >= 8)
+	{
+		bw->out->push_back((uchar)bw->bits);
+		bw->bits >>= 8;
+		bw->count -= 8;
 	}
+}
 
-	file.close();
-	
-	return colors;
+/*
+ * Writes a Huffman code, which deflate stores most significant bit first.
+ */
+void putCode(BitWriter *bw, uint32_t code, int n)
+{
+	uint32_t r;
+	int i;
+	r = 0;
+	for (i = 0; i < n; i++)
+		r |= ((code >> i) & 1) << (n - 1 - i);
+	putBits(bw, r, n);
 }
 
-void cameraFromFile(Point3D *pos, Point3D *dir, Point3D *up, char *fileName) {
-	ifstream file;
-	file.open(fileName);
-	file >> pos->x >> pos->y >> pos->z;
-	file >> dir->x >> dir->y >> dir->z;
-	file >> up->x >> up->y >> up->z;
-	file.close();
+void flushBits(BitWriter *bw)
+{
+	if (bw->count > 0)
+		putBits(bw, 0, 8 - bw->count);
 }
 
-Point3D lightFromFile(char *fileName) {
-	Point3D light;
-	ifstream file;
-	file.open(fileName);
-	file >> light.x >> light.y >> light.z;
-	file.close();
+/*
+ * Literal/length symbol s with the fixed Huffman code of RFC 1951.
+ */
+void putFixedSymbol(BitWriter *bw, int s)
+{
+	if (s < 144)
+		putCode(bw, 0x30 + s, 8);
+	else if (s < 256)
+		putCode(bw, 0x190 + s - 144, 9);
+	else if (s < 280)
+		putCode(bw, s - 256, 7);
+	else
+		putCode(bw, 0xC0 + s - 280, 8);
 }
 
-void drawMap3D(Canvas *canvas, Map3D *map, Point3D dir, Matrix *t, double scale)
+void putFixedMatch(BitWriter *bw, int length, int distance)
 {
-	Map3D::iterator i;
-	Face3D::iterator j;
-	Face3D f;
-	Point3D p_1, p_2, p_3, v_1, v_2;
-	Point3D n;
-	Matrix *pm, *r_1, *r_2, *r_3;
-	for (i = map->begin(); i != map->end(); i++)
-	{
-		f = *i;
-		j = f.begin();
-		p_1 = *j;
-		j++;
-		p_2 = *j;
-		j++;
-		p_3 = *j;
-		v_1 = pointDiff(p_1, p_2);
-		v_2 = pointDiff(p_1, p_3);
-		n = cross3D(v_1, v_2);
-		/*if (dot3D(*n, dir) < 0.0)
-		{*/
-			pm = point3DToMatrix(p_1);
-			r_1 = multMatrix(t, pm);
-			pm = point3DToMatrix(p_2);
-			r_2 = multMatrix(t, pm);
-			pm = point3DToMatrix(p_3);
-			r_3 = multMatrix(t, pm);
-			drawScaledLine(canvas, r_1->val[0][0], r_1->val[1][0], r_2->val[0][0], r_2->val[1][0], scale / r_1->val[3][0], scale / r_2->val[3][0], COLOR_WHITE);
-			drawScaledLine(canvas, r_1->val[0][0], r_1->val[1][0], r_3->val[0][0], r_3->val[1][0], scale / r_1->val[3][0], scale / r_3->val[3][0], COLOR_WHITE);
-			drawScaledLine(canvas, r_2->val[0][0], r_2->val[1][0], r_3->val[0][0], r_3->val[1][0], scale / r_2->val[3][0], scale / r_3->val[3][0], COLOR_WHITE);
-		/*}*/
-	}
+	static const int LENGTH_BASE[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+	static const int LENGTH_EXTRA[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+	static const int DIST_BASE[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+	static const int DIST_EXTRA[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+	int c;
+	for (c = 28; LENGTH_BASE[c] > length; c--)
+		;
+	putFixedSymbol(bw, 257 + c);
+	putBits(bw, length - LENGTH_BASE[c], LENGTH_EXTRA[c]);
+	for (c = 29; DIST_BASE[c] > distance; c--)
+		;
+	putCode(bw, c, 5);
+	putBits(bw, distance - DIST_BASE[c], DIST_EXTRA[c]);
 }
 
-int main(int argc, char **argv) {
-	Map3D *map;
-	Point3D center = {0.0, 0.0, 0.0};
-	Point3D dir = {0.0, 0.0, 1.0};
-	Point3D up = {0.0, 1.0, 0.0};
-	Point3D light = {0.0, 0.0, 1.0};
-	Canvas *canvas;
-	int w, h;
-	int i;
-	double scale;
-	bool zEn = true, ilum = true;
-	bool wireframe = false;
-	char filename[1024];
-	char rfilename[1024];
-	w = 1920;
-	h = 1080;
-	scale = 500.0;
-	strcpy(filename, "in");
-	for (i = 1; i < argc; i++)
+/*
+ * Compresses in[0 .. n) as a run of deflate blocks ending on a byte boundary:
+ * stored blocks, or one fixed Huffman block with greedy LZ77 matching
+ * followed by an empty stored block. Only the last strip sets BFINAL, so the
+ * strips of an image, each compressed on its own, simply concatenate.
+ */
+void deflateStrip(const uchar *in, size_t n, bool stored, bool last, vector<uchar> *out)
+{
+	const int HASH_BITS = 15, WINDOW = 32768, MAX_CHAIN = 16;
+	BitWriter bw;
+	size_t i, len, chunk, best, dist;
+	int k, chain;
+	uint32_t hsh;
+	vector<int> head, prev;
+	bw.out = out;
+	bw.bits = 0;
+	bw.count = 0;
+	out->clear();
+	if (stored)
 	{
-		if ((strcmp(argv[i], "-w") == 0) || (strcmp(argv[i], "--width") == 0))
+		i = 0;
+		do
 		{
-			i++;
-			sscanf(argv[i], "%d", &w);
+			chunk = min(n - i, (size_t)65535);
+			putBits(&bw, (last && i + chunk == n) ? 1 : 0, 1);
+			putBits(&bw, 0, 2);
+			flushBits(&bw);
+			putBits(&bw, (uint32_t)chunk, 16);
+			putBits(&bw, (uint32_t)chunk ^ 0xFFFF, 16);
+			out->insert(out->end(), in + i, in + i + chunk);
+			i += chunk;
+		} while (i < n);
+		return;
+	}
+	putBits(&bw, last ? 1 : 0, 1);
+	putBits(&bw, 1, 2);
+	head.assign(1 << HASH_BITS, -1);
+	prev.resize(n);
+	i = 0;
+	while (i < n)
+	{
+		best = 0;
+		dist = 0;
+		if (i + 3 <= n)
+		{
+			hsh = ((in[i] << 10) ^ (in[i + 1] << 5) ^ in[i + 2]) & ((1 << HASH_BITS) - 1);
+			for (k = head[hsh], chain = 0; k >= 0 && i - k <= (size_t)WINDOW && chain < MAX_CHAIN; k = prev[k], chain++)
+			{
+				for (len = 0; i + len < n && len < 258 && in[k + len] == in[i + len]; len++)
+					;
+				if (len > best)
+				{
+					best = len;
+					dist = i - k;
+					if (len == 258)
+						break;
+				}
+			}
 		}
-		else if ((strcmp(argv[i], "-h") == 0) || (strcmp(argv[i], "--height") == 0))
+		if (best >= 3)
 		{
-			i++;
-			sscanf(argv[i], "%d", &h);
+			putFixedMatch(&bw, (int)best, (int)dist);
+			len = best;
 		}
-		else if (strcmp(argv[i], "c") == 0)
+		else
 		{
-			i++;
-			sscanf(argv[i], "%lf", &center.x);
-			i++;
-			sscanf(argv[i], "%lf", &center.y);
-			i++;
-			sscanf(argv[i], "%lf", &center.z);
+			putFixedSymbol(&bw, in[i]);
+			len = 1;
 		}
-		else if (strcmp(argv[i], "d") == 0)
+		for (; len > 0; len--, i++)
 		{
-			i++;
-			sscanf(argv[i], "%lf", &dir.x);
-			i++;
-			sscanf(argv[i], "%lf", &dir.y);
-			i++;
-			sscanf(argv[i], "%lf", &dir.z);
+			if (i + 3 <= n)
+			{
+				hsh = ((in[i] << 10) ^ (in[i + 1] << 5) ^ in[i + 2]) & ((1 << HASH_BITS) - 1);
+				prev[i] = head[hsh];
+				head[hsh] = (int)i;
+			}
 		}
-		else if (strcmp(argv[i], "u") == 0)
+	}
+	putFixedSymbol(&bw, 256);
+	if (!last)
+	{
+		putBits(&bw, 0, 3);
+		flushBits(&bw);
+		putBits(&bw, 0, 16);
+		putBits(&bw, 0xFFFF, 16);
+	}
+	flushBits(&bw);
+}
+
+uint32_t adler32(const uchar *p, size_t n)
+{
+	uint32_t a, b;
+	size_t k;
+	a = 1;
+	b = 0;
+	while (n > 0)
+	{
+		k = min(n, (size_t)5552);
+		n -= k;
+		for (; k > 0; k--, p++)
 		{
-			i++;
-			sscanf(argv[i], "%lf", &up.x);
-			i++;
-			sscanf(argv[i], "%lf", &up.y);
-			i++;
-			sscanf(argv[i], "%lf", &up.z);
+			a += *p;
+			b += a;
 		}
-		else if ((strcmp(argv[i], "-s") == 0) || (strcmp(argv[i], "--scale") == 0))
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+/*
+ * Adler-32 of two concatenated blocks from the checksums of each, where the
+ * second one is n bytes long (as zlib's adler32_combine).
+ */
+uint32_t adler32Combine(uint32_t a_1, uint32_t a_2, size_t n)
+{
+	const uint32_t BASE = 65521;
+	uint32_t rem, s_1, s_2;
+	rem = (uint32_t)(n % BASE);
+	s_1 = a_1 & 0xFFFF;
+	s_2 = (uint32_t)(((uint64_t)rem * s_1) % BASE);
+	s_1 += (a_2 & 0xFFFF) + BASE - 1;
+	s_2 += (a_1 >> 16) + (a_2 >> 16) + BASE - rem;
+	if (s_1 >= BASE)
+		s_1 -= BASE;
+	if (s_1 >= BASE)
+		s_1 -= BASE;
+	if (s_2 >= 2 * BASE)
+		s_2 -= 2 * BASE;
+	if (s_2 >= BASE)
+		s_2 -= BASE;
+	return (s_2 << 16) | s_1;
+}
+
+uint32_t crc32(uint32_t crc, const uchar *p, size_t n)
+{
+	static uint32_t table[256];
+	static bool ready = false;
+	uint32_t c;
+	int i, k;
+	if (!ready)
+	{
+		for (i = 0; i < 256; i++)
 		{
-			i++;
-			sscanf(argv[i], "%lf", &scale);
+			c = i;
+			for (k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			table[i] = c;
 		}
-		else if ((strcmp(argv[i], "-W") == 0) || (strcmp(argv[i], "--wireframe") == 0))
+		ready = true;
+	}
+	crc = ~crc;
+	while (n-- > 0)
+		crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+/*
+ * Filters the rows of one PNG strip, choosing per row the filter (none, sub
+ * or up) with the smallest sum of absolute differences, and deflates them.
+ * The first row only tries up if the canvas still holds the row above it.
+ */
+void pngStrip(Canvas *canvas, int imageH, int strip, bool stored, bool last, vector<uchar> *out, uint32_t *adler, size_t *size)
+{
+	int r_0, r_1, r, f, best, filters;
+	size_t x, n, cost, bestCost;
+	vector<uchar> above, row, filtered, data;
+	uchar v;
+	stripRows(imageH, strip, &r_0, &r_1);
+	n = 3 * (size_t)canvas->w;
+	above.assign(n, 0);
+	row.resize(n);
+	filtered.resize(3 * (n + 1));
+	filters = 3;
+	if (r_0 > 0 && imageH - r_0 < canvas->originY + canvas->h)
+		canvasRow(canvas, imageH - r_0, &above[0]);
+	else if (r_0 > 0)
+		filters = 2;
+	for (r = r_0; r < r_1; r++, filters = 3)
+	{
+		canvasRow(canvas, imageH - 1 - r, &row[0]);
+		best = 0;
+		bestCost = 0;
+		for (f = 0; f < filters; f++)
 		{
-			wireframe = true;
+			cost = 0;
+			filtered[f * (n + 1)] = (uchar)f;
+			for (x = 0; x < n; x++)
+			{
+				if (f == 0)
+					v = row[x];
+				else if (f == 1)
+					v = row[x] - (x >= 3 ? row[x - 3] : 0);
+				else
+					v = row[x] - above[x];
+				filtered[f * (n + 1) + 1 + x] = v;
+				cost += (v < 128) ? v : 256 - v;
+			}
+			if (f == 0 || cost < bestCost)
+			{
+				best = f;
+				bestCost = cost;
+			}
 		}
-		else if (strcmp(argv[i], "--depthdisable") == 0)
+		data.insert(data.end(), filtered.begin() + best * (n + 1), filtered.begin() + (best + 1) * (n + 1));
+		above.swap(row);
+	}
+	*adler = adler32(data.empty() ? NULL : &data[0], data.size());
+	*size = data.size();
+	deflateStrip(data.empty() ? NULL : &data[0], data.size(), stored, last, out);
+}
+
+void putPngChunk(FILE *out, const char *type, const uchar *data, size_t n)
+{
+	vector<uchar> head;
+	uint32_t crc;
+	putBE32(&head, (uint32_t)n);
+	head.insert(head.end(), type, type + 4);
+	crc = crc32(0, &head[4], 4);
+	crc = crc32(crc, data, n);
+	fwrite(&head[0], 1, head.size(), out);
+	if (n > 0)
+		fwrite(data, 1, n, out);
+	head.clear();
+	putBE32(&head, crc);
+	fwrite(&head[0], 1, 4, out);
+}
+
+/*
+ * Opens filename, or standard output for "-", for an image of w x h pixels
+ * and writes the format header. A PPM file is sized up front and mapped, so
+ * strips are copied straight to their place; stdio is only used if it cannot
+ * be mapped. Y4M and raw RGB writers take one frame after another until they
+ * are closed.
+ */
+ImageWriter *openImageWriter(const char *filename, ImageFormat format, bool stored, int w, int h)
+{
+	ImageWriter *iw;
+	char header[64];
+	int n;
+	vector<uchar> v;
+	iw = new ImageWriter;
+	iw->format = format;
+	iw->stored = stored;
+	iw->w = w;
+	iw->h = h;
+	iw->strips = (h + STRIP_ROWS - 1) / STRIP_ROWS;
+	iw->out = NULL;
+	iw->map = NULL;
+	iw->pixels = NULL;
+	iw->adler = 1;
+	if (format == IMAGE_PPM)
+	{
+		n = sprintf(header, "P6\n%d %d\n%d\n", w, h, 255);
+		if (strcmp(filename, "-") != 0)
+			iw->map = createMappedFile(filename, n + (size_t)3 * w * h);
+		if (iw->map != NULL)
 		{
-			zEn = false;
+			memcpy((char *)iw->map->data, header, n);
+			iw->pixels = (uchar *)iw->map->data + n;
+			return iw;
 		}
-		else if (strcmp(argv[i], "--ambient") == 0)
+		v.assign(header, header + n);
+	}
+	else if (format == IMAGE_QOI)
+	{
+		v.insert(v.end(), "qoif", "qoif" + 4);
+		putBE32(&v, w);
+		putBE32(&v, h);
+		v.push_back(3);
+		v.push_back(0);
+	}
+	else if (format == IMAGE_Y4M)
+	{
+		n = sprintf(header, "YUV4MPEG2 W%d H%d F25:1 Ip A1:1 C420jpeg\n", w, h);
+		v.assign(header, header + n);
+		iw->chroma.resize(2 * (size_t)((w + 1) / 2) * ((h + 1) / 2));
+	}
+	if (strcmp(filename, "-") == 0)
+	{
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		iw->out = stdout;
+	}
+	else
+	{
+		iw->out = fopen(filename, "wb");
+	}
+	if (iw->out == NULL)
+	{
+		delete iw;
+		return NULL;
+	}
+	if (format == IMAGE_PNG)
+	{
+		fwrite("\x89PNG\r\n\x1a\n", 1, 8, iw->out);
+		putBE32(&v, w);
+		putBE32(&v, h);
+		v.push_back(8);
+		v.push_back(2);
+		v.push_back(0);
+		v.push_back(0);
+		v.push_back(0);
+		putPngChunk(iw->out, "IHDR", &v[0], v.size());
+	}
+	else if (!v.empty())
+	{
+		fwrite(&v[0], 1, v.size(), iw->out);
+	}
+	return iw;
+}
+
+/*
+ * Encodes strip k of the image, whose rows the canvas must hold, into data
+ * (and, for PNG, the Adler-32 and length of its uncompressed bytes). Strips
+ * are independent, so any number can be encoded at once; a mapped PPM is
+ * copied into place right here.
+ */
+void encodeImageStrip(ImageWriter *iw, Canvas *canvas, int k, vector<uchar> *data, uint32_t *adler, size_t *size)
+{
+	int r_0, r_1, r;
+	size_t cw, plane;
+	data->clear();
+	if (iw->format == IMAGE_QOI)
+	{
+		qoiStrip(canvas, iw->h, k, data);
+	}
+	else if (iw->format == IMAGE_Y4M)
+	{
+		stripRows(iw->h, k, &r_0, &r_1);
+		cw = (iw->w + 1) / 2;
+		plane = iw->chroma.size() / 2;
+		data->resize((size_t)iw->w * (r_1 - r_0));
+		yuvStrip(canvas, iw->h, k, &(*data)[0], &iw->chroma[cw * (r_0 / 2)], &iw->chroma[plane + cw * (r_0 / 2)]);
+	}
+	else if (iw->format == IMAGE_PNG)
+	{
+		pngStrip(canvas, iw->h, k, iw->stored, k == iw->strips - 1, data, adler, size);
+	}
+	else
+	{
+		stripRows(iw->h, k, &r_0, &r_1);
+		if (iw->pixels == NULL)
+			data->resize((size_t)3 * iw->w * (r_1 - r_0));
+		for (r = r_0; r < r_1; r++)
+			canvasRow(canvas, iw->h - 1 - r, (iw->pixels != NULL ? iw->pixels + (size_t)3 * iw->w * r : &(*data)[(size_t)3 * iw->w * (r - r_0)]));
+	}
+}
+
+/*
+ * Appends an encoded strip to the file. Strips must come in order.
+ */
+void writeImageStrip(ImageWriter *iw, int k, vector<uchar> &data, uint32_t adler, size_t size)
+{
+	vector<uchar> v;
+	if (iw->format == IMAGE_PNG)
+	{
+		if (k == 0)
 		{
-			ilum = false;
+			v.push_back(0x78);
+			v.push_back(0x01);
+			iw->adler = adler;
 		}
 		else
 		{
-			sscanf(argv[i], "%s", filename);
+			iw->adler = adler32Combine(iw->adler, adler, size);
 		}
+		v.insert(v.end(), data.begin(), data.end());
+		putPngChunk(iw->out, "IDAT", v.data(), v.size());
 	}
-	canvas = createCanvas(w, h);
-	canvas->zEnabled = zEn;
-	strcpy(rfilename, filename);
-	strcat(rfilename, ".raw");
-	map = openRawMap(rfilename);
-	strcpy(rfilename, filename);
-	strcat(rfilename, ".scene");
-	cameraFromFile(&center, &dir, &up, rfilename);
-	Matrix *t;
-	t = createProjectionMatrix(center, dir, up, -2, 2);
-	if (wireframe)
+	else if (iw->format == IMAGE_Y4M)
+	{
+		if (k == 0)
+			fputs("FRAME\n", iw->out);
+		if (!data.empty())
+			fwrite(&data[0], 1, data.size(), iw->out);
+		if (k == iw->strips - 1 && !iw->chroma.empty())
+			fwrite(&iw->chroma[0], 1, iw->chroma.size(), iw->out);
+	}
+	else if (iw->out != NULL && !data.empty())
+	{
+		fwrite(&data[0], 1, data.size(), iw->out);
+	}
+}
+
+/*
+ * Writes the format trailer and closes the file.
+ */
+bool closeImageWriter(ImageWriter *iw)
+{
+	vector<uchar> v;
+	bool ok;
+	ok = true;
+	if (iw->map != NULL)
 	{
-		drawMap3D(canvas, map, dir, t, scale);
+		unmapFile(iw->map);
 	}
 	else
 	{
-		strcpy(rfilename, filename);
-		strcat(rfilename, ".material");
-		vector<Color> cl = colorsFromMaterial(rfilename);
-		strcpy(rfilename, filename);
-		strcat(rfilename, ".light");
-		light = lightFromFile(rfilename);
-		drawFilledMap3D(canvas, map, dir, light, ilum, t, scale, cl);
+		if (iw->format == IMAGE_QOI)
+		{
+			v.assign(8, 0);
+			v[7] = 1;
+			fwrite(&v[0], 1, v.size(), iw->out);
+		}
+		else if (iw->format == IMAGE_PNG)
+		{
+			if (iw->strips == 0)
+			{
+				v.push_back(0x78);
+				v.push_back(0x01);
+				v.push_back(0x01);
+				v.push_back(0x00);
+				v.push_back(0x00);
+				v.push_back(0xFF);
+				v.push_back(0xFF);
+			}
+			putBE32(&v, iw->adler);
+			putPngChunk(iw->out, "IDAT", &v[0], v.size());
+			putPngChunk(iw->out, "IEND", NULL, 0);
+		}
+		ok = !ferror(iw->out);
+		if (iw->out == stdout)
+			ok = (fflush(stdout) == 0) && ok;
+		else
+			ok = (fclose(iw->out) == 0) && ok;
 	}
-	canvasToPPM(canvas, "out.ppm");
-	return EXIT_SUCCESS;
+	delete iw;
+	return ok;
 }
 
-void swap(int *a, int *b) {
-	int c;
-	c = *a;
-	*a = *b;
-	*b = c;
+/*
+ * Writes the strips of the image held by the canvas, which must follow the
+ * last strip written. Strips are encoded in parallel on the pool and then
+ * written in order.
+ */
+void writeCanvasStrips(ImageWriter *iw, Canvas *canvas, ThreadPool *pool)
+{
+	int first, count, s;
+	vector< vector<uchar> > data;
+	vector<uint32_t> adler;
+	vector<size_t> size;
+	first = (iw->h - canvas->originY - canvas->h) / STRIP_ROWS;
+	count = min(iw->strips, (iw->h - canvas->originY + STRIP_ROWS - 1) / STRIP_ROWS) - first;
+	data.resize(count);
+	adler.resize(count);
+	size.resize(count);
+	parallelFor(pool, count, [&](int k) { encodeImageStrip(iw, canvas, first + k, &data[k], &adler[k], &size[k]); });
+	for (s = 0; s < count; s++)
+		writeImageStrip(iw, first + s, data[s], adler[s], size[s]);
 }
 
-void swapDouble(double *a, double *b) {
-	double c;
-	c = *a;
-	*a = *b;
-	*b = c;
+/*
+ * Consumer side of pipelined output: encodes and writes each strip as soon
+ * as all its rows are final, while the tiles below are still being drawn.
+ */
+void outputPipeWorker(OutputPipe *pipe)
+{
+	int k, r_0, r_1;
+	vector<uchar> data;
+	uint32_t adler;
+	size_t size;
+	for (k = 0; k < pipe->writer->strips; k++)
+	{
+		stripRows(pipe->writer->h, k, &r_0, &r_1);
+		{
+			unique_lock<mutex> l(pipe->lock);
+			pipe->ready.wait(l, [&] { return pipe->finalRows >= r_1; });
+		}
+		encodeImageStrip(pipe->writer, pipe->canvas, k, &data, &adler, &size);
+		writeImageStrip(pipe->writer, k, data, adler, size);
+	}
 }
 
-void drawPixelZ(Canvas *canvas, int x, int y, double z, Color c) {
-	if (x < 0 || y < 0 || x >= canvas->w || y >= canvas->h)
-		return;
-	if (canvas->zEnabled && (z > canvas->z[x][y] || z < 0))
-		return;
-	canvas->z[x][y] = z;
-	canvas->col[x][y] = c;
+/*
+ * Starts writing canvas through iw on a thread of its own. The renderer
+ * reports finished tiles with pipeTileDone; finishOutputPipe marks the rest
+ * of the image final and waits for the writer, which is left open.
+ */
+OutputPipe *startOutputPipe(Canvas *canvas, ImageWriter *iw)
+{
+	OutputPipe *pipe;
+	pipe = new OutputPipe;
+	pipe->writer = iw;
+	pipe->canvas = canvas;
+	pipe->pending.assign(canvas->tilesY, canvas->tilesX);
+	pipe->finalRows = 0;
+	pipe->consumer = thread(outputPipeWorker, pipe);
+	return pipe;
 }
 
-void drawPixel(Canvas *canvas, int x, int y, Color c) {
-	if (x < 0 || y < 0 || x >= canvas->w || y >= canvas->h)
-		return;
-	canvas->col[x][y] = c;
+/*
+ * Called once per finished tile of row ty. When the tile rows from the top
+ * of the image down to some row are all complete, their pixel rows become
+ * final for the writer.
+ */
+void pipeTileDone(OutputPipe *pipe, int ty)
+{
+	int t, rows;
+	lock_guard<mutex> l(pipe->lock);
+	pipe->pending[ty]--;
+	rows = pipe->finalRows;
+	for (t = pipe->canvas->tilesY - 1; t >= 0 && pipe->pending[t] == 0; t--)
+		rows = pipe->canvas->h - t * TILE_SIZE;
+	if (rows > pipe->finalRows)
+	{
+		pipe->finalRows = rows;
+		pipe->ready.notify_one();
+	}
 }
 
-void drawLine(Canvas *canvas, int x_1, int y_1, int x_2, int y_2, Color c) {
-	int sx, sy;
-	int err, e2;
-	int dx, dy;
-	dx = abs(x_2 - x_1);
-	dy = abs(y_2 - y_1);
-	sx = (x_1 < x_2) ? 1 : -1;
-	sy = (y_1 < y_2) ? 1 : -1;
-	err = dx - dy;
-	drawPixel(canvas, x_1, y_1, c);
-	while (x_1 != x_2 || y_1 != y_2) {
-		e2 = 2 * err;
-		if (e2 > -dy) { 
-			err -= dy;
-			x_1 += sx;
+void finishOutputPipe(OutputPipe *pipe)
+{
+	{
+		lock_guard<mutex> l(pipe->lock);
+		pipe->finalRows = pipe->canvas->h;
+	}
+	pipe->ready.notify_one();
+	pipe->consumer.join();
+	delete pipe;
+}
+
+/*
+ * Output format chosen by the extension of filename; PPM when it is not
+ * .qoi, .png, .y4m or .rgb.
+ */
+ImageFormat imageFormat(const char *filename)
+{
+	size_t len;
+	len = strlen(filename);
+	if (len > 4 && strcmp(filename + len - 4, ".qoi") == 0)
+		return IMAGE_QOI;
+	if (len > 4 && strcmp(filename + len - 4, ".png") == 0)
+		return IMAGE_PNG;
+	if (len > 4 && strcmp(filename + len - 4, ".y4m") == 0)
+		return IMAGE_Y4M;
+	if (len > 4 && strcmp(filename + len - 4, ".rgb") == 0)
+		return IMAGE_RGB;
+	return IMAGE_PPM;
+}
+
+int64_t floorDiv(int64_t a, int64_t b)
+{
+	return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+/*
+ * Coverage of one 8x8 block, bit 8 * j + i for pixel (i, j) of the block.
+ * Only the edges in partial are tested; e[k] is edge k at the block's first
+ * pixel, dx[k] / dy[k] its step per pixel. When small is set every value in
+ * the block fits in 32 bits and rows are evaluated 4 or 8 pixels at a time.
+ */
+uint64_t blockCoverage(int partial, const int64_t *e, const int64_t *dx, const int64_t *dy, bool small)
+{
+	uint64_t mask;
+	int i, j, k, neg;
+	int64_t v;
+	mask = 0;
+	if (small)
+	{
+#if defined(__AVX2__)
+		__m256i step[3];
+		for (k = 0; k < 3; k++)
+		{
+			if (partial & (1 << k))
+				step[k] = _mm256_mullo_epi32(_mm256_set1_epi32((int)dx[k]), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
 		}
-		if (e2 < dx) { 
-			err += dx;
-			y_1 += sy; 
+		for (j = 0; j < 8; j++)
+		{
+			neg = 0;
+			for (k = 0; k < 3; k++)
+			{
+				if (partial & (1 << k))
+					neg |= _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_add_epi32(_mm256_set1_epi32((int)(e[k] + j * dy[k])), step[k])));
+			}
+			mask |= (uint64_t)(~neg & 0xFF) << (8 * j);
 		}
-		drawPixel(canvas, x_1, y_1, c);
+		return mask;
+#elif defined(USE_SSE2)
+		__m128i lo[3], hi[3], r;
+		for (k = 0; k < 3; k++)
+		{
+			if (partial & (1 << k))
+			{
+				lo[k] = _mm_setr_epi32(0, (int)dx[k], (int)(2 * dx[k]), (int)(3 * dx[k]));
+				hi[k] = _mm_add_epi32(lo[k], _mm_set1_epi32((int)(4 * dx[k])));
+			}
+		}
+		for (j = 0; j < 8; j++)
+		{
+			neg = 0;
+			for (k = 0; k < 3; k++)
+			{
+				if (partial & (1 << k))
+				{
+					r = _mm_set1_epi32((int)(e[k] + j * dy[k]));
+					neg |= _mm_movemask_ps(_mm_castsi128_ps(_mm_add_epi32(r, lo[k])));
+					neg |= _mm_movemask_ps(_mm_castsi128_ps(_mm_add_epi32(r, hi[k]))) << 4;
+				}
+			}
+			mask |= (uint64_t)(~neg & 0xFF) << (8 * j);
+		}
+		return mask;
+#endif
 	}
+	for (j = 0; j < 8; j++)
+		for (i = 0; i < 8; i++)
+		{
+			for (k = 0; k < 3; k++)
+			{
+				v = e[k] + i * dx[k] + j * dy[k];
+				if ((partial & (1 << k)) && v < 0)
+					break;
+			}
+			if (k == 3)
+				mask |= (uint64_t)1 << (8 * j + i);
+		}
+	return mask;
 }
 
-void drawScanline(Canvas *canvas, int x_1, int x_2, int y, double z_1, double z_2, Color c)
+/*
+ * Sets up the triangle (ax, ay, az), (bx, by, bz), (cx, cy, cz) for the
+ * pixels of [x_0, x_1) x [y_0, y_1). Returns false if it has no area, lies
+ * too far off the screen to snap, or covers none of those pixels.
+ */
+bool setupEdges(int x_0, int y_0, int x_1, int y_1, float ax, float ay, float az, float bx, float by, float bz, float cx, float cy, float cz, EdgeSetup *es)
 {
-	double dz, mz;
-	if (x_1 > x_2)
+	const double LIMIT = (double)(1 << 26);
+	int64_t X[3], Y[3], area, minX, maxX, minY, maxY;
+	float *fx, *fy, *fz;
+	double det;
+	int k, n;
+	fx = es->fx;
+	fy = es->fy;
+	fz = es->fz;
+	fx[0] = ax; fy[0] = ay; fz[0] = az;
+	fx[1] = bx; fy[1] = by; fz[1] = bz;
+	fx[2] = cx; fy[2] = cy; fz[2] = cz;
+	for (k = 0; k < 3; k++)
 	{
-		swap(&x_1, &x_2);
-		swapDouble(&z_1, &z_2);
+		if (!(fabs(fx[k]) < LIMIT && fabs(fy[k]) < LIMIT))
+			return false;
+		X[k] = llround(fx[k] * 16.0);
+		Y[k] = llround(fy[k] * 16.0);
 	}
-	dz = (z_2 - z_1) / (x_2 - x_1);
-	mz = z_1;
-	while (x_1 <= x_2)
+	area = (X[1] - X[0]) * (Y[2] - Y[0]) - (Y[1] - Y[0]) * (X[2] - X[0]);
+	if (area == 0)
 	{
-		drawPixelZ(canvas, x_1, y, mz, c);
-		x_1++;
-		mz += dz;
+		return false;
+	}
+	if (area < 0)
+	{
+		swap(X[1], X[2]);
+		swap(Y[1], Y[2]);
+		swap(fx[1], fx[2]);
+		swap(fy[1], fy[2]);
+		swap(fz[1], fz[2]);
+	}
+	es->small = true;
+	for (k = 0; k < 3; k++)
+	{
+		n = (k + 1) % 3;
+		es->A[k] = Y[k] - Y[n];
+		es->B[k] = X[n] - X[k];
+		es->C[k] = (Y[n] - Y[k]) * X[k] - (X[n] - X[k]) * Y[k];
+		if (!(es->A[k] > 0 || (es->A[k] == 0 && es->B[k] < 0)))
+			es->C[k] -= 1;
+		if (es->A[k] > (1 << 22) || es->A[k] < -(1 << 22) || es->B[k] > (1 << 22) || es->B[k] < -(1 << 22))
+			es->small = false;
+		es->dx[k] = 16 * es->A[k];
+		es->dy[k] = 16 * es->B[k];
 	}
+	minX = min(X[0], min(X[1], X[2]));
+	maxX = max(X[0], max(X[1], X[2]));
+	minY = min(Y[0], min(Y[1], Y[2]));
+	maxY = max(Y[0], max(Y[1], Y[2]));
+	es->xmin = (int)max((int64_t)x_0, floorDiv(minX - 8 + 15, 16));
+	es->xmax = (int)min((int64_t)x_1 - 1, floorDiv(maxX - 8, 16));
+	es->ymin = (int)max((int64_t)y_0, floorDiv(minY - 8 + 15, 16));
+	es->ymax = (int)min((int64_t)y_1 - 1, floorDiv(maxY - 8, 16));
+	if (es->xmin > es->xmax || es->ymin > es->ymax)
+	{
+		return false;
+	}
+	det = ((double)fx[1] - fx[0]) * ((double)fy[2] - fy[0]) - ((double)fx[2] - fx[0]) * ((double)fy[1] - fy[0]);
+	if (det != 0.0)
+	{
+		es->dzdx = (((double)fz[1] - fz[0]) * ((double)fy[2] - fy[0]) - ((double)fz[2] - fz[0]) * ((double)fy[1] - fy[0])) / det;
+		es->dzdy = (((double)fx[1] - fx[0]) * ((double)fz[2] - fz[0]) - ((double)fx[2] - fx[0]) * ((double)fz[1] - fz[0])) / det;
+	}
+	else
+	{
+		es->dzdx = es->dzdy = 0.0;
+	}
+	return true;
 }
 
-void drawTriangle(Canvas *canvas, int x_1, int y_1, double z_1, int x_2, int y_2, double z_2, int x_3, int y_3, double z_3, Color c)
+/*
+ * Evaluates the edges of es at the first pixel of the 8x8 block whose first
+ * pixel is (blockX, blockY), into e. Returns -1 if the block is wholly outside
+ * an edge, otherwise the edges that cross it, as partial for blockCoverage.
+ */
+inline int blockEdges(const EdgeSetup *es, int blockX, int blockY, int64_t *e)
 {
-	int dx_1, dy_1, dx_2, dy_2, sx_1, sx_2;
-	double dz_1, dz_2;
-	int mx_1, mx_2, y;
-	double mz_1, mz_2;
-	int err_1, err_2;
-	if (y_2 < y_1)
+	int64_t v, lo, hi;
+	int k, partial;
+	partial = 0;
+	for (k = 0; k < 3; k++)
 	{
-		swap(&x_1, &x_2);
-		swap(&y_1, &y_2);
-		swapDouble(&z_1, &z_2);
-	}
-	if (y_3 < y_1)
-	{
-		swap(&x_1, &x_3);
-		swap(&y_1, &y_3);
-		swapDouble(&z_1, &z_3);
+		e[k] = es->A[k] * (blockX * 16 + 8) + es->B[k] * (blockY * 16 + 8) + es->C[k];
+		lo = hi = e[k];
+		v = e[k] + 7 * es->dx[k];
+		lo = min(lo, v);
+		hi = max(hi, v);
+		v = e[k] + 7 * es->dy[k];
+		lo = min(lo, v);
+		hi = max(hi, v);
+		v = e[k] + 7 * es->dx[k] + 7 * es->dy[k];
+		lo = min(lo, v);
+		hi = max(hi, v);
+		if (hi < 0)
+			return -1;
+		if (lo < 0)
+			partial |= 1 << k;
 	}
-	if (y_3 < y_2)
+	return partial;
+}
+
+/*
+ * Half-space triangle rasterizer, an alternative to drawTriangle. Vertices are
+ * snapped to 1/16 pixel and pixels are sampled at their centers. The bounding
+ * box is walked in 8x8 blocks: blocks outside an edge are skipped, blocks
+ * inside all three edges are filled without per-pixel edge tests, and the rest
+ * are evaluated with blockCoverage. Pixels on an edge belong to the triangle
+ * only if it is a top or left edge, so triangles sharing an edge never both
+ * draw it. Depth is interpolated from the triangle's plane equation. Only
+ * pixels inside [x_0, x_1) x [y_0, y_1), in image rows, are touched; blocks
+ * are aligned to the canvas origin, which does not change any pixel.
+ */
+void drawTriangleEdge(Canvas *canvas, int x_0, int y_0, int x_1, int y_1, float ax, float ay, float az, float bx, float by, float bz, float cx, float cy, float cz, Color c, int id)
+{
+	EdgeSetup es;
+	int64_t e[3];
+	const float *fx, *fy, *fz;
+	double dzdx, dzdy, z, zrow, zNear, margin;
+	float zFar;
+	int i, j, partial, py, xmin, xmax, ymin, ymax, blockX, blockY, localY, oy, row;
+	uint64_t mask, clip;
+	size_t base, at;
+	uchar *rgb;
+	bool written;
+	long long blocks, blocksCulled, fragments, fragmentsWritten;
+	oy = canvas->originY;
+	if (!setupEdges(x_0, y_0, x_1, y_1, ax, ay, az, bx, by, bz, cx, cy, cz, &es))
 	{
-		swap(&x_2, &x_3);
-		swap(&y_2, &y_3);
-		swapDouble(&z_2, &z_3);
+		return;
 	}
-	dx_2 = abs(x_3 - x_1);
-	sx_2 = (x_3 > x_1) ? 1 : -1;
-	dy_2 = y_3 - y_1;
-	if (y_1 == y_2)
+	fx = es.fx;
+	fy = es.fy;
+	fz = es.fz;
+	dzdx = es.dzdx;
+	dzdy = es.dzdy;
+	xmin = es.xmin;
+	xmax = es.xmax;
+	ymin = es.ymin;
+	ymax = es.ymax;
+	if (canvas->zEnabled)
 	{
-		if (y_2 == y_3)
+		/*
+		 * Nearest depth the triangle can write inside the clip rect: the plane
+		 * at the corners of the covered pixel range, and the nearest vertex
+		 * less what snapping to 1/16 pixel can add. margin covers rounding.
+		 */
+		margin = 1e-9 * (fabs(fz[0]) + fabs(dzdx) * (fabs(fx[0]) + x_1) + fabs(dzdy) * (fabs(fy[0]) + y_1));
+		zNear = fz[0] + (xmin + 0.5 - fx[0]) * dzdx + (ymin + 0.5 - fy[0]) * dzdy;
+		zNear = min(zNear, fz[0] + (xmax + 0.5 - fx[0]) * dzdx + (ymin + 0.5 - fy[0]) * dzdy);
+		zNear = min(zNear, fz[0] + (xmin + 0.5 - fx[0]) * dzdx + (ymax + 0.5 - fy[0]) * dzdy);
+		zNear = min(zNear, fz[0] + (xmax + 0.5 - fx[0]) * dzdx + (ymax + 0.5 - fy[0]) * dzdy);
+		zNear = max(zNear, min(fz[0], min(fz[1], fz[2])) - (fabs(dzdx) + fabs(dzdy)) / 16.0) - margin;
+		zFar = -numeric_limits<float>::max();
+		for (j = (ymin - oy) / TILE_SIZE; j <= (ymax - oy) / TILE_SIZE; j++)
+			for (i = xmin / TILE_SIZE; i <= xmax / TILE_SIZE; i++)
+				zFar = max(zFar, hizTileMax(canvas, i, j));
+		if ((float)zNear > zFar)
 		{
-			drawScanline(canvas, x_1, x_2, y_1, z_1, z_2, c);
-			drawScanline(canvas, x_2, x_3, y_1, z_2, z_3, c);
+			if (canvas->stats != NULL)
+			{
+				canvas->stats->triangles++;
+				canvas->stats->trianglesCulled++;
+			}
 			return;
 		}
-		drawScanline(canvas, x_1, x_2, y_1, z_1, z_2, c);
-		err_2 = dx_2;
-		mx_2 = x_1 + sx_2 * (err_2 / dy_2);
-		err_2 = err_2 % dy_2;
-		dz_2 = (z_3 - z_1) / dy_2; 
-		mz_2 = z_1 + dz_2;
 	}
-	else
+	blocks = blocksCulled = fragments = fragmentsWritten = 0;
+	for (blockY = ((ymin - oy) & ~7) + oy; blockY <= ymax; blockY += 8)
 	{
-		dx_1 = abs(x_2 - x_1);
-		sx_1 = (x_2 > x_1) ? 1 : -1;
-		dy_1 = y_2 - y_1;
-		y = y_1;
-		mx_1 = mx_2 = x_1;
-		err_1 = err_2 = 0;
-		dz_1 = (z_2 - z_1) / dy_1;
-		dz_2 = (z_3 - z_1) / dy_2;
-		mz_1 = mz_2 = z_1;
-		while (y <= y_2)
+		localY = blockY - oy;
+		for (blockX = xmin & ~7; blockX <= xmax; blockX += 8)
 		{
-			drawScanline(canvas, mx_1, mx_2, y, mz_1, mz_2, c);
-			y++;
-			err_1 += dx_1;
-			err_2 += dx_2;
-			mx_1 += sx_1 * (err_1 / dy_1);
-			mx_2 += sx_2 * (err_2 / dy_2);
-			err_1 = err_1 % dy_1;
-			err_2 = err_2 % dy_2;
-			mz_1 += dz_1;
-			mz_2 += dz_2;
+			partial = blockEdges(&es, blockX, blockY, e);
+			if (partial < 0)
+			{
+				continue;
+			}
+			blocks++;
+			if (canvas->zEnabled)
+			{
+				/*
+				 * Depth is evaluated per pixel exactly as below and is
+				 * monotonic along both axes, so the nearest sample of the
+				 * block is at one of its corners.
+				 */
+				zrow = fz[0] + (blockX + 0.5 - fx[0]) * dzdx + (blockY + 0.5 - fy[0]) * dzdy;
+				zNear = min(zrow, zrow + 7 * dzdx);
+				zrow = fz[0] + (blockX + 0.5 - fx[0]) * dzdx + (blockY + 7 + 0.5 - fy[0]) * dzdy;
+				zNear = min(zNear, min(zrow, zrow + 7 * dzdx));
+				if ((float)zNear > hizBlockMax(canvas, blockX >> 3, localY >> 3))
+				{
+					blocksCulled++;
+					continue;
+				}
+			}
+			/*
+			 * Pixels of the block inside the clip rect and the bounding
+			 * box, as a row mask repeated over the rows that are.
+			 */
+			row = 0xFF;
+			if (blockX < xmin)
+				row &= 0xFF << (xmin - blockX);
+			if (blockX + 7 > xmax)
+				row &= 0xFF >> (blockX + 7 - xmax);
+			clip = 0;
+			for (j = max(0, ymin - blockY); j < 8 && blockY + j <= ymax; j++)
+				clip |= (uint64_t)(row & 0xFF) << (8 * j);
+			mask = clip;
+			if (partial)
+			{
+				mask &= blockCoverage(partial, e, es.dx, es.dy, es.small);
+			}
+			if (!tileLive(canvas, blockX, localY))
+				clearTile(canvas, blockX / TILE_SIZE, localY / TILE_SIZE);
+			written = false;
+			base = canvasBlockIndex(canvas, blockX, localY);
+			rgb = (canvas->layout == LAYOUT_TILED) ? canvas->rgb + 3 * base : canvasColor(canvas, blockX, localY);
+			for (j = 0; j < 8 && mask != 0; j++, mask >>= 8)
+			{
+				if ((mask & 0xFF) == 0)
+					continue;
+				py = blockY + j;
+				zrow = fz[0] + (blockX + 0.5 - fx[0]) * dzdx + (py + 0.5 - fy[0]) * dzdy;
+				for (i = 0; i < 8; i++)
+				{
+					if (!(mask & ((uint64_t)1 << i)))
+						continue;
+					z = zrow + i * dzdx;
+					fragments++;
+					at = base + canvas->blockOffset[8 * j + i];
+					if (canvas->zEnabled && ((float)z > canvas->z[at] || z < 0))
+						continue;
+					canvas->z[at] = (float)z;
+					if (canvas->id != NULL)
+						canvas->id[at] = id;
+					else
+						putColor(rgb + canvas->colorOffset[8 * j + i], c);
+					fragmentsWritten++;
+					written = true;
+				}
+			}
+			if (written)
+			{
+				hizMark(canvas, blockX, localY);
+			}
 		}
 	}
-	if (y_2 != y_3)
+	if (canvas->stats != NULL)
 	{
-		dx_1 = abs(x_3 - x_2);
-		dy_1 = y_3 - y_2;
-		sx_1 = (x_3 > x_2) ? 1 : -1;
-		y = y_2 + 1;
-		mx_1 = x_2 + sx_1 * (dx_1 / dy_1);
-		err_1 = dx_1 % dy_1;
-		dz_1 = (z_3 - z_2) / dy_1;
-		mz_1 = z_2 + dz_1;
-		while(y <= y_3)
-		{
-			drawScanline(canvas, mx_1, mx_2, y, mz_1, mz_2, c);
-			y++;
-			err_1 += dx_1;
-			err_2 += dx_2;
-			mx_1 += sx_1 * (err_1 / dy_1);
-			mx_2 += sx_2 * (err_2 / dy_2);
-			err_1 = err_1 % dy_1;
-			err_2 = err_2 % dy_2;
-			mz_1 += dz_1;
-			mz_2 += dz_2;
-		}
+		canvas->stats->triangles++;
+		canvas->stats->blocks += blocks;
+		canvas->stats->blocksCulled += blocksCulled;
+		canvas->stats->fragments += fragments;
+		canvas->stats->fragmentsWritten += fragmentsWritten;
 	}
 }
 
-Canvas *createCanvas(int w, int h) {
-	int i, j;
-	Canvas *c;
-	double **z;
-	Color **col;
-	col = new Color*[w];
-	z = new double*[w];
-	for (i = 0; i < w; i++) {
-		col[i] = new Color[h];
-		z[i] = new double[w];
-		for (j = 0; j < h; j++) {
-			col[i][j] = COLOR_BLACK;
-			z[i][j] = numeric_limits<double>::max();
-		}
+/*
+ * Draws a triangle into the occlusion buffer with the coverage of
+ * drawTriangleEdge. Its depth bound is the farthest vertex plus what
+ * snapping to 1/16 pixel can add, so it is never nearer than any pixel the
+ * triangle will write. Triangles reaching z < 0, where nothing is written,
+ * are left out.
+ */
+void drawOccluder(Occlusion *occ, float ax, float ay, float az, float bx, float by, float bz, float cx, float cy, float cz)
+{
+	EdgeSetup es;
+	int64_t e[3];
+	double slack, zFar;
+	float z;
+	int partial, blockX, blockY, cell;
+	uint64_t m;
+	if (!setupEdges(0, 0, occ->width, occ->height, ax, ay, az, bx, by, bz, cx, cy, cz, &es))
+	{
+		return;
 	}
-	c = new Canvas;
-	c->col = col;
-	c->w = w;
-	c->h = h;
-	c->z = z;
-	c->zEnabled;
-	return c;
-}
-
-void canvasToPPM(Canvas *canvas, const char *filename) {
-	FILE *out;
-	int i, j;
-	out = fopen(filename, "w");
-	fprintf(out, "P6\n%d %d\n%d\n", canvas->w, canvas->h, 255);
-	for (j = canvas->h - 1; j >= 0; j--)
-		for (i = 0; i < canvas->w; i++)
+	slack = (fabs(es.dzdx) + fabs(es.dzdy)) / 16.0;
+	if (min(es.fz[0], min(es.fz[1], es.fz[2])) - slack <= 0.0)
+	{
+		return;
+	}
+	zFar = max(es.fz[0], max(es.fz[1], es.fz[2])) + slack;
+	z = (float)(zFar * (1.0 + 1e-5));
+	for (blockY = es.ymin & ~7; blockY <= es.ymax; blockY += 8)
+	{
+		for (blockX = es.xmin & ~7; blockX <= es.xmax; blockX += 8)
 		{
-			fwrite(&canvas->col[i][j].r, 1, 1, out);
-			fwrite(&canvas->col[i][j].g, 1, 1, out);
-			fwrite(&canvas->col[i][j].b, 1, 1, out);
+			partial = blockEdges(&es, blockX, blockY, e);
+			if (partial < 0)
+			{
+				continue;
+			}
+			m = partial ? blockCoverage(partial, e, es.dx, es.dy, es.small) : ~(uint64_t)0;
+			cell = (blockY >> 3) * occ->cols + (blockX >> 3);
+			if ((m | occlusionOutside(occ, blockX >> 3, blockY >> 3)) == ~(uint64_t)0)
+			{
+				/*
+				 * Covering the whole cell, the triangle alone bounds it.
+				 */
+				occ->zMax[cell] = (occ->mask[cell] == ~(uint64_t)0) ? min(occ->zMax[cell], z) : z;
+				occ->mask[cell] = ~(uint64_t)0;
+			}
+			else if (occ->mask[cell] != ~(uint64_t)0)
+			{
+				occ->mask[cell] |= m;
+				occ->zMax[cell] = max(occ->zMax[cell], z);
+			}
 		}
-	fclose(out);
+	}
 }
-